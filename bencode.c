@@ -24,11 +24,122 @@
 #define EAT(BUF,LEN) (BUF)++,(LEN)--
 #define EAT_N(BUF,LEN,N) (BUF)+=(N),(LEN)-=(N)
 
+#define BE_CLONE_ROOT  -1   // refcnt of a be_clone() root, owns the block
+#define BE_CLONE_INNER -2   // refcnt of every other node in the block; a dict
+                            // entry and its key are in the block iff its val is
+/* refcnt changes under other threads once a node is shared */
+#define REFCNT(N) __atomic_load_n(&(N)->refcnt, __ATOMIC_RELAXED)
+
 //#define BE_DEBUG
 
+#ifdef BE_STATS
+#include <pthread.h>
+#include <time.h>
+
+/* Every thread owns one slot and is its only writer. Stores are relaxed
+   atomics so that a scraper thread may read them concurrently; on x86 and
+   arm64 they compile to plain loads and stores. */
+typedef struct be_stats_slot {
+    struct be_stats_slot *next;
+    be_stats_t s;
+} be_stats_slot_t;
+
+static pthread_mutex_t be_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t be_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t be_stats_key;
+static be_stats_slot_t *be_stats_threads;  // live threads
+static be_stats_t be_stats_retired;        // counters of exited threads
+static __thread be_stats_slot_t *be_stats_self;
+
+#define STAT_LOAD(F) __atomic_load_n(&(F), __ATOMIC_RELAXED)
+#define STAT_SET(F,V) __atomic_store_n(&(F), (V), __ATOMIC_RELAXED)
+#define STAT_ADD(F,V) STAT_SET(F, (F) + (V))
+
+static void be_stats_exit(void *arg) {
+    be_stats_slot_t *slot = arg, **p;
+
+    pthread_mutex_lock(&be_stats_lock);
+    for (p = &be_stats_threads; *p; p = &(*p)->next) {
+        if (*p == slot) {
+            *p = slot->next;
+            break;
+        }
+    }
+    be_stats_merge(&be_stats_retired, &slot->s);
+    pthread_mutex_unlock(&be_stats_lock);
+    BE_FREE(slot);
+}
+
+static void be_stats_init(void) {
+    pthread_key_create(&be_stats_key, be_stats_exit);
+}
+
+static be_stats_slot_t *be_stats_get(void) {
+    be_stats_slot_t *slot = be_stats_self;
+
+    if (slot)
+        return slot;
+    pthread_once(&be_stats_once, be_stats_init);
+    if ((slot = BE_CALLOC(1, sizeof(be_stats_slot_t))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&be_stats_lock);
+    slot->next = be_stats_threads;
+    be_stats_threads = slot;
+    pthread_mutex_unlock(&be_stats_lock);
+    pthread_setspecific(be_stats_key, slot);
+    be_stats_self = slot;
+    return slot;
+}
+
+static unsigned long long be_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void be_stats_record(enum be_stats_op op, unsigned long long t0) {
+    be_stats_slot_t *slot = be_stats_get();
+    unsigned long long ns = be_now_ns() - t0;
+    int b = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    be_op_stats_t *o;
+
+    if (slot == NULL)
+        return;
+    if (b >= BE_STATS_BUCKETS)
+        b = BE_STATS_BUCKETS - 1;
+    o = &slot->s.op[op];
+    STAT_ADD(o->count, 1);
+    STAT_ADD(o->total_ns, ns);
+    STAT_ADD(o->hist[b], 1);
+    if (ns > o->max_ns)
+        STAT_SET(o->max_ns, ns);
+}
+
+#define STATS_BEGIN(T) unsigned long long T = be_now_ns()
+#define STATS_END(OP,T) be_stats_record(OP, T)
+#define STATS_ADD(FIELD,V) do {                                 \
+        be_stats_slot_t *slot_ = be_stats_get();                \
+        if (slot_) STAT_ADD(slot_->s.FIELD, V);                 \
+    } while (0)
+#define STATS_MAX(FIELD,V) do {                                 \
+        be_stats_slot_t *slot_ = be_stats_get();                \
+        if (slot_ && (V) > slot_->s.FIELD)                      \
+            STAT_SET(slot_->s.FIELD, V);                        \
+    } while (0)
+#define STATS_ERR(E) STATS_ADD(errors[(E) > 0 && (E) < BE_STATS_MAX_ERRNO ? \
+                                      (E) : BE_STATS_MAX_ERRNO - 1], 1)
+#else
+#define STATS_BEGIN(T)
+#define STATS_END(OP,T) do { } while (0)
+#define STATS_ADD(FIELD,V) do { } while (0)
+#define STATS_MAX(FIELD,V) do { } while (0)
+#define STATS_ERR(E) do { } while (0)
+#endif
+
 be_node_t *be_alloc(enum be_type type) {
     be_node_t *ret = BE_CALLOC(1, sizeof(be_node_t));
     if (ret) {
+        STATS_ADD(nodes_created, 1);
         ret->type = type;
         init_list_head(&ret->link);
         if (type == LIST)
@@ -39,11 +150,55 @@ be_node_t *be_alloc(enum be_type type) {
     return ret;
 }
 
-void be_free(be_node_t *node) {
+static void be_free1(be_node_t *node);
+
+/* Free what was added to a clone since it was made, keeping the block. */
+static void be_clone_release(be_node_t *node) {
+    list_t *l, *tmp;
+
+    switch (node->type) {
+    case LIST:
+        list_for_each_safe(l, tmp, &node->x.list_head) {
+            be_node_t *entry = list_entry(l, be_node_t, link);
+            if (REFCNT(entry) == BE_CLONE_INNER)
+                be_clone_release(entry);
+            else
+                be_free1(entry);
+        }
+        break;
+    case DICT:
+        list_for_each_safe(l, tmp, &node->x.dict_head) {
+            be_dict_t *entry = list_entry(l, be_dict_t, link);
+            if (REFCNT(entry->val) == BE_CLONE_INNER) {
+                be_clone_release(entry->val);
+                continue;
+            }
+            BE_FREE(entry->key.buf);
+            be_free1(entry->val);
+            BE_FREE(entry);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void be_free1(be_node_t *node) {
     list_t *l, *tmp;
 
     if (node == NULL)
         return;
+    if (REFCNT(node) < 0) {     // be_clone() block: only the root frees it
+        if (REFCNT(node) == BE_CLONE_ROOT) {
+            list_del(&node->link);
+            be_clone_release(node);
+            BE_FREE(node);
+        }
+        return;
+    }
+    if (REFCNT(node) &&
+        __atomic_sub_fetch(&node->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;     // frozen and still shared
     
     list_del(&node->link);
     switch (node->type) {
@@ -55,17 +210,23 @@ void be_free(be_node_t *node) {
     case LIST:
         list_for_each_safe(l, tmp, &node->x.list_head) {
             be_node_t *entry = list_entry(l, be_node_t, link);
-            be_free(entry);
+            be_free1(entry);
         }
         break;
     case DICT:
         list_for_each_safe(l, tmp, &node->x.dict_head) {
             be_dict_t *entry = list_entry(l, be_dict_t, link);
             BE_FREE(entry->key.buf);
-            be_free(entry->val);
+            be_free1(entry->val);
             BE_FREE(entry);
         }
         break;
+    case REF:
+        be_free1(node->x.ref);
+        break;
+    case LAZY:  // the span belongs to the caller's input buffer
+    case COMPACT:   // so do the arrays; the descriptor is part of node
+        break;
     default:
         assert(0);
         break;
@@ -73,6 +234,12 @@ void be_free(be_node_t *node) {
     BE_FREE(node);
 }
 
+void be_free(be_node_t *node) {
+    STATS_BEGIN(t0);
+    be_free1(node);
+    STATS_END(BE_OP_FREE, t0);
+}
+
 /* Parse until non-digit marker occurs.
    'e' = '-e' = '00e' = ':' = '-:' = '00:'= 0
    '999999999999999999999999999999999999999999999999999999999e' = LLONG_MAX
@@ -155,7 +322,7 @@ out:
     } while (0)
 #define CHECK2(COND, CODE) do {                 \
         if (COND) {                             \
-            be_free(ret);                       \
+            be_free1(ret);                      \
             ret = NULL;                         \
             DO_ERR(CODE);                       \
         }                                       \
@@ -166,13 +333,17 @@ out:
         CHECK(((LEN) == 0));                    \
     } while (0)
 
-static be_node_t *be_decode1(const char *buf, size_t len, size_t *rx, int depth) {
+static int be_check1(const char *buf, size_t len, size_t *rx, int depth);
+
+/* composites nested deeper than levels are validated but left LAZY */
+static be_node_t *be_decode1(const char *buf, size_t len, size_t *rx, int depth, int levels) {
     size_t orglen = len, n;
     be_node_t *ret = NULL, *entry;
 
 #ifdef BE_DEBUG
     printf("%s: %s %d %d\n", __FUNCTION__, buf, (int) len, depth);
 #endif
+    STATS_MAX(max_depth, depth);
     
     if (depth > BE_MAX_DEPTH) {   // recursion threshold exceeded
         errno = ELOOP;
@@ -184,6 +355,18 @@ static be_node_t *be_decode1(const char *buf, size_t len, size_t *rx, int depth)
         goto out;
     }
 
+    if (depth > levels && (*buf == 'l' || *buf == 'd')) {
+        if (be_check1(buf, len, &n, depth) < 0) {
+            EAT_N(buf,len,n);
+            goto out;
+        }
+        ALLOC(LAZY);
+        ret->x.raw.buf = (char *) buf;
+        ret->x.raw.len = n;
+        EAT_N(buf,len,n);
+        goto out;
+    }
+
     switch (*buf) {
     case 'i':
         ALLOC(NUM);
@@ -203,7 +386,7 @@ static be_node_t *be_decode1(const char *buf, size_t len, size_t *rx, int depth)
         ALLOC(LIST);
         EAT_CHECK(buf,len);
         while (*buf != 'e') { // "le" return empty list
-            entry = be_decode1(buf, len, &n, depth+1);
+            entry = be_decode1(buf, len, &n, depth+1, levels);
             EAT_N(buf,len,n);
             CHECK((entry == NULL));
             list_add_tail(&entry->link, &ret->x.list_head);
@@ -223,7 +406,7 @@ static be_node_t *be_decode1(const char *buf, size_t len, size_t *rx, int depth)
             dict_entry->key = be_decode_str(buf, len, &n);
             EAT_N(buf,len,n);
             CHECK((dict_entry->key.buf == NULL));
-            dict_entry->val = be_decode1(buf, len, &n, depth+1);
+            dict_entry->val = be_decode1(buf, len, &n, depth+1, levels);
             EAT_N(buf,len,n);
             CHECK((dict_entry->val == NULL));
             CHECK((len == 0));
@@ -240,13 +423,171 @@ out:
     return ret;
 }
 
+/* be_check1() accepts exactly what be_decode1() does, without building */
+static long long int be_check_str(const char *buf, size_t len, size_t *rx) {
+    size_t orglen = len, n;
+    long long int slen = be_decode_int(buf, len, &n);
+
+    EAT_N(buf,len,n);
+    if ((len == 0) ||
+        (slen < 0 || slen > len - 1) ||
+        (*buf != ':'))
+        slen = -1;
+    else
+        EAT_N(buf,len,slen+1);
+    *rx = orglen - len;
+    return slen;
+}
+
+static int be_check1(const char *buf, size_t len, size_t *rx, int depth) {
+    size_t orglen = len, n;
+    int ret = -1;
+    char type;
+
+    if (depth > BE_MAX_DEPTH) {
+        errno = ELOOP;
+        goto out;
+    }
+    if (len == 0) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    switch (*buf) {
+    case 'i':
+        EAT(buf,len);
+        if (len == 0)
+            goto inval;
+        be_decode_int(buf, len, &n);
+        EAT_N(buf,len,n);
+        if (len == 0 || *buf != 'e')
+            goto inval;
+        EAT(buf,len);
+        break;
+    case '0'...'9':
+        if (be_check_str(buf, len, &n) < 0) {
+            EAT_N(buf,len,n);
+            goto inval;
+        }
+        EAT_N(buf,len,n);
+        break;
+    case 'l':
+    case 'd':
+        type = *buf;
+        EAT(buf,len);
+        if (len == 0)
+            goto inval;
+        while (*buf != 'e') {
+            if (type == 'd') {
+                if (be_check_str(buf, len, &n) < 0) {
+                    EAT_N(buf,len,n);
+                    goto inval;
+                }
+                EAT_N(buf,len,n);
+            }
+            if (be_check1(buf, len, &n, depth+1) < 0) {
+                EAT_N(buf,len,n);
+                goto out;
+            }
+            EAT_N(buf,len,n);
+            if (len == 0)
+                goto inval;
+        }
+        EAT(buf,len);
+        break;
+    default:
+        goto inval;
+    }
+    ret = 0;
+    goto out;
+
+inval:
+    errno = EINVAL;
+out:
+    *rx = orglen - len;
+    return ret;
+}
+
+/* Validate one bencode value at inBuf without building it. Returns 0 and
+   sets *readAmount like be_decode(), or -1 with the same errno values. */
+int be_check(const char *inBuf, size_t inBufLen, size_t *readAmount) {
+    return be_check1(inBuf, inBufLen, readAmount, 1);
+}
+
+/* Like be_decode(), but composites nested deeper than levels are only
+   validated and stay LAZY until first accessed. */
+be_node_t *be_decode_lazy(const char *inBuf, size_t inBufLen, size_t *readAmount, int levels) {
+    be_node_t *ret;
+    STATS_BEGIN(t0);
+
+    ret = be_decode1(inBuf, inBufLen, readAmount, 1, levels);
+    if (ret)
+        STATS_ADD(bytes_decoded, *readAmount);
+    else
+        STATS_ERR(errno);
+    STATS_END(BE_OP_DECODE, t0);
+    return ret;
+}
+
+/* Materialize a LAZY node one level deep, in place; its composite
+   children stay LAZY. Other nodes are left alone. */
+int be_expand(be_node_t *node) {
+    be_node_t *tmp;
+    size_t n;
+
+    if (node == NULL || node->type != LAZY)
+        return 0;
+    // validated at decode time, so only allocation can fail
+    if ((tmp = be_decode1(node->x.raw.buf, node->x.raw.len, &n, 1, 1)) == NULL)
+        return -1;
+    node->type = tmp->type;
+    init_list_head(&node->x.list_head);
+    list_splice_init(&tmp->x.list_head, &node->x.list_head);
+    be_free1(tmp);
+    return 0;
+}
+
+static list_t be_no_children = LIST_HEAD_INIT(be_no_children);
+
+/* Head of a list or dict's children, expanding it first if it is LAZY.
+   Gives an empty list if that fails or node is not a composite. */
+list_t *be_children(be_node_t *node) {
+    node = be_deref(node);
+    if (be_expand(node) < 0 || (node->type != LIST && node->type != DICT))
+        return &be_no_children;
+    return &node->x.list_head;
+}
+
+/* Step of be_for_each(): expand the child at pos, unless pos is the end. */
+list_t *be_child_next(list_t *head, list_t *pos) {
+    be_node_t *parent;
+
+    if (pos == head || head == &be_no_children)
+        return pos;
+    parent = list_entry(head, be_node_t, x.list_head);
+    if (parent->type == DICT)
+        be_expand(list_entry(pos, be_dict_t, link)->val);
+    else
+        be_expand(list_entry(pos, be_node_t, link));
+    return pos;
+}
+
 /* when error, errno is set:
    ENOMEM: malloc failed
    ELOOP:  recursion threshold met
    EINVAL: bad format bencode file
 */
 be_node_t *be_decode(const char *inBuf, size_t inBufLen, size_t *readAmount) {
-    return be_decode1(inBuf, inBufLen, readAmount, 1);
+    be_node_t *ret;
+    STATS_BEGIN(t0);
+
+    ret = be_decode1(inBuf, inBufLen, readAmount, 1, INT_MAX);
+    if (ret)
+        STATS_ADD(bytes_decoded, *readAmount);
+    else
+        STATS_ERR(errno);
+    STATS_END(BE_OP_DECODE, t0);
+    return ret;
 }
 
 static void newline(int indent) {
@@ -272,7 +613,14 @@ static void be_dump1(be_node_t *node, int indent) {
     int sz, first = 1;
     list_t *l;
     
+    if (be_expand(node) < 0) {
+        printf("<%lld bytes>", node->x.raw.len);
+        return;
+    }
     switch (node->type) {
+    case REF:
+        be_dump1(node->x.ref, indent);
+        break;
     case NUM:
         printf("%lld", node->x.num);
         break;
@@ -308,6 +656,12 @@ static void be_dump1(be_node_t *node, int indent) {
             be_dump1(entry->val, indent+sz+4);
         }
         printf("}");
+        break;
+    case COMPACT:
+        printf("<%zu compact entries>", node->x.compact->n);
+        break;
+    case LAZY:  // expanded above
+        break;
     }
 }
 
@@ -334,11 +688,114 @@ static ssize_t be_encode_str(const be_str_t *str, char *outBuf, size_t outBufLen
     return sz + str->len;
 }
 
-/*
-  when outBuf == NULL, be_encode returns outBufLen needed 
-*/
-ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
+/* bencode orders dict keys as raw byte strings */
+static int be_str_cmp(const be_str_t *a, const be_str_t *b) {
+    int r = memcmp(a->buf, b->buf, a->len < b->len ? a->len : b->len);
+
+    if (r != 0)
+        return r;
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+typedef struct be_dict_ent {
+    const be_dict_t *e;
+    size_t idx;         // list position, keeps the sort stable
+} be_dict_ent_t;
+
+static int be_dict_ent_cmp(const void *a, const void *b) {
+    const be_dict_ent_t *x = a, *y = b;
+    int r = be_str_cmp(&x->e->key, &y->e->key);
+
+    if (r != 0)
+        return r;
+    return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+static ssize_t be_encode1(const be_node_t *node, char *outBuf, size_t outBufLen, int canonical);
+
+/* the raw span may not be canonical; sort it through a throwaway tree */
+static ssize_t be_encode_lazy_canonical(const be_node_t *node, char *outBuf, size_t outBufLen) {
+    be_node_t *tmp;
+    ssize_t r;
+    size_t n;
+
+    if ((tmp = be_decode1(node->x.raw.buf, node->x.raw.len, &n, 1, INT_MAX)) == NULL)
+        return -1;
+    r = be_encode1(tmp, outBuf, outBufLen, 1);
+    be_free1(tmp);
+    return r;
+}
+
+/* Are the dict's keys in order? Duplicates are allowed, encoding skips them. */
+static int be_dict_in_order(const be_node_t *node) {
+    const be_str_t *prev = NULL;
+    list_t *l;
+
+    list_for_each(l, &node->x.dict_head) {
+        be_dict_t *entry = list_entry(l, be_dict_t, link);
+        if (prev && be_str_cmp(prev, &entry->key) > 0)
+            return 0;
+        prev = &entry->key;
+    }
+    return 1;
+}
+
+/* Slow path of be_encode_canonical() for a dict whose entries are out of
+   order: encode them through a sorted index, leaving the tree untouched. */
+static ssize_t be_encode_dict_sorted(const be_node_t *node, char *outBuf, size_t outBufLen) {
+    be_dict_ent_t *ent;
+    size_t i, n = 0;
+    ssize_t r, sz = 2;
+    list_t *l;
+
+    list_for_each(l, &node->x.dict_head)
+        n++;
+    if ((ent = BE_MALLOC(n * sizeof(*ent))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    n = 0;
+    list_for_each(l, &node->x.dict_head) {
+        ent[n].e = list_entry(l, be_dict_t, link);
+        ent[n].idx = n;
+        n++;
+    }
+    qsort(ent, n, sizeof(*ent), be_dict_ent_cmp);
+
+    if (outBuf) {
+        *outBuf = 'd';
+        EAT(outBuf, outBufLen);
+    }
+    for (i = 0; i < n; i++) {
+        if (i > 0 && be_str_cmp(&ent[i-1].e->key, &ent[i].e->key) == 0)
+            continue;
+        r = be_encode_str(&ent[i].e->key, outBuf, outBufLen);
+        if (r < 0)
+            goto err;
+        if (outBuf) EAT_N(outBuf, outBufLen, r);
+        sz += r;
+        r = be_encode1(ent[i].e->val, outBuf, outBufLen, 1);
+        if (r < 0)
+            goto err;
+        if (outBuf) EAT_N(outBuf, outBufLen, r);
+        sz += r;
+    }
+    if (outBuf) {
+        if (outBufLen == 0)
+            goto err;
+        *outBuf = 'e';
+    }
+    BE_FREE(ent);
+    return sz;
+
+err:
+    BE_FREE(ent);
+    return -1;
+}
+
+static ssize_t be_encode1(const be_node_t *node, char *outBuf, size_t outBufLen, int canonical) {
     char tmpBuf[TMPBUFLEN];
+    const be_str_t *prev = NULL;
     ssize_t r;
     int sz = 1;
     list_t *l;
@@ -347,6 +804,21 @@ ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
         return -1;
     
     switch (node->type) {
+    case REF:
+        return be_encode1(node->x.ref, outBuf, outBufLen, canonical);
+    case COMPACT:
+        return be_encode_compact(node->x.compact->kind, node->x.compact->ids,
+                                 node->x.compact->addrs, node->x.compact->ports,
+                                 node->x.compact->n, outBuf, outBufLen);
+    case LAZY:
+        if (canonical)
+            return be_encode_lazy_canonical(node, outBuf, outBufLen);
+        if (outBuf) {   // untouched: the original bytes are already encoded
+            if (node->x.raw.len > outBufLen)
+                return -1;
+            memcpy(outBuf, node->x.raw.buf, node->x.raw.len);
+        }
+        return node->x.raw.len;
     case NUM:
         sz = snprintf(tmpBuf, TMPBUFLEN, "i%llde", node->x.num);
         if (outBuf != NULL) {
@@ -367,7 +839,7 @@ ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
         }
         list_for_each(l, &node->x.list_head) {
             be_node_t *entry = list_entry(l, be_node_t, link);
-            r = be_encode(entry, outBuf, outBufLen);
+            r = be_encode1(entry, outBuf, outBufLen, canonical);
 #define CHECK_AND_UPDATE do {                               \
                 if (r < 0) return -1;                       \
                 if (outBuf) EAT_N(outBuf, outBufLen, r);    \
@@ -384,6 +856,8 @@ ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
         sz++;
         break;
     case DICT:
+        if (canonical && !be_dict_in_order(node))
+            return be_encode_dict_sorted(node, outBuf, outBufLen);
         if (outBuf) {
             *outBuf = 'd';
             EAT(outBuf, outBufLen);
@@ -391,10 +865,15 @@ ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
         list_for_each(l, &node->x.list_head) {
             be_dict_t *entry = list_entry(l, be_dict_t, link);
 
+            // duplicate: the first one wins, as in lookup
+            if (canonical && prev && be_str_cmp(prev, &entry->key) == 0)
+                continue;
+            prev = &entry->key;
+
             r = be_encode_str(&entry->key, outBuf, outBufLen);
             CHECK_AND_UPDATE;
             
-            r = be_encode(entry->val, outBuf, outBufLen);
+            r = be_encode1(entry->val, outBuf, outBufLen, canonical);
             CHECK_AND_UPDATE;
         }
         if (outBuf) {
@@ -407,30 +886,82 @@ ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
     }
     return sz;
 }
+
+/*
+  when outBuf == NULL, be_encode returns outBufLen needed 
+*/
+ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen) {
+    ssize_t ret;
+    STATS_BEGIN(t0);
+
+    ret = be_encode1(node, outBuf, outBufLen, 0);
+    if (outBuf && ret > 0)
+        STATS_ADD(bytes_encoded, ret);
+    STATS_END(BE_OP_ENCODE, t0);
+    return ret;
+}
+
+/*
+  Like be_encode(), but dict keys come out sorted and deduplicated as the
+  spec requires, whatever order they were added in. Dicts that are
+  already sorted cost one key comparison per entry extra.
+*/
+ssize_t be_encode_canonical(const be_node_t *node, char *outBuf, size_t outBufLen) {
+    ssize_t ret;
+    STATS_BEGIN(t0);
+
+    ret = be_encode1(node, outBuf, outBufLen, 1);
+    if (outBuf && ret > 0)
+        STATS_ADD(bytes_encoded, ret);
+    STATS_END(BE_OP_ENCODE, t0);
+    return ret;
+}
 /*************************/
 void be_dict_free(be_dict_t *dict) {
     if (dict == NULL)
         return;
     list_del(&dict->link);
+    if (REFCNT(dict->val) == BE_CLONE_INNER) {  // entry of a be_clone() block
+        be_clone_release(dict->val);
+        return;
+    }
     BE_FREE(dict->key.buf);
     be_free(dict->val);
     BE_FREE(dict);
 }
 
+/* be_dict_free() that checks entry's owner: frozen dicts are read-only,
+   as in be_dict_add(). */
+int be_dict_del(be_node_t *dict, be_dict_t *entry) {
+    if (REFCNT(be_deref(dict)) > 0) {
+        errno = EPERM;
+        return -1;
+    }
+    be_dict_free(entry);
+    return 0;
+}
+
 be_node_t *be_dict_lookup(be_node_t *node, const char *key, be_dict_t **dict_entry) {
+    be_node_t *ret = NULL;
     list_t *l;
+    STATS_BEGIN(t0);
 
-    if (node->type != DICT)
-        return NULL;
+    node = be_deref(node);
+    if (be_expand(node) < 0 || node->type != DICT)
+        goto out;
     list_for_each(l, &node->x.dict_head) {
         be_dict_t *entry = list_entry(l, be_dict_t, link);
 
         if (entry->key.buf && (strcmp(key, entry->key.buf) == 0)) {
             if (dict_entry) *dict_entry = entry;
-            return entry->val;
+            // callers see a materialized node, as with be_decode()
+            ret = be_expand(entry->val) < 0 ? NULL : entry->val;
+            break;
         }
     }
-    return NULL;
+out:
+    STATS_END(BE_OP_LOOKUP, t0);
+    return ret;
 }
 long long int be_dict_lookup_num(be_node_t *node, const char *key) {
     be_node_t *entry;
@@ -455,6 +986,18 @@ char *be_dict_lookup_cstr_size(be_node_t *node, const char *key, int *size) {
     return entry->x.str.buf;
 }
 int be_dict_add(be_node_t *dict, const char *keystr, be_node_t *val) {
+    if (be_expand(dict) < 0)
+        return -1;
+    if (REFCNT(dict) > 0) {
+        errno = EPERM;
+        return -1;
+    }
+    // a clone's nodes stay in place, and a clone can't own another clone
+    if (val && (REFCNT(val) == BE_CLONE_INNER ||
+                (REFCNT(val) == BE_CLONE_ROOT && REFCNT(dict) < 0))) {
+        errno = EINVAL;
+        return -1;
+    }
     be_dict_t *dict_entry = BE_CALLOC(1, sizeof(be_dict_t));
     if (dict_entry == NULL)
         return -1; 
@@ -472,13 +1015,105 @@ int be_dict_add(be_node_t *dict, const char *keystr, be_node_t *val) {
     list_add_tail(&dict_entry->link, &dict->x.dict_head);
     return 0;
 }
+/* like be_dict_add(), but val is released on failure */
+static int be_dict_add_own(be_node_t *dict, const char *keystr, be_node_t *val) {
+    if (be_dict_add(dict, keystr, val) < 0) {
+        be_free1(val);
+        return -1;
+    }
+    return 0;
+}
+/* Insert keeping the dict sorted. Keys arriving in order take O(1);
+   for bulk adds in random order, be_dict_add() then be_dict_sort() is
+   cheaper. Fails with EEXIST if the key is already present. */
+int be_dict_add_sorted(be_node_t *dict, const char *keystr, be_node_t *val) {
+    be_str_t key = { .buf = (char *) keystr, .len = strlen(keystr) };
+    be_dict_t *entry;
+    list_t *l;
+    int cmp = -1;
+
+    if (be_expand(dict) < 0)
+        return -1;
+    for (l = dict->x.dict_head.prev; l != &dict->x.dict_head; l = l->prev) {
+        cmp = be_str_cmp(&list_entry(l, be_dict_t, link)->key, &key);
+        if (cmp <= 0)
+            break;
+    }
+    if (cmp == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (be_dict_add(dict, keystr, val) < 0)
+        return -1;
+    entry = list_entry(dict->x.dict_head.prev, be_dict_t, link);
+    list_del(&entry->link);
+    list_add(&entry->link, l);
+    return 0;
+}
+
+/* merge two NULL terminated runs chained by ->next, a before b on ties */
+static list_t *be_dict_merge(list_t *a, list_t *b) {
+    list_t head, *tail = &head;
+
+    while (a && b) {
+        if (be_str_cmp(&list_entry(a, be_dict_t, link)->key,
+                       &list_entry(b, be_dict_t, link)->key) <= 0) {
+            tail->next = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b = b->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
+/* Stable bottom-up merge sort of the dict entries by key, in place and
+   without allocating. Duplicate keys stay in insertion order. */
+int be_dict_sort(be_node_t *dict) {
+    list_t *head = &dict->x.dict_head, *run[64] = { NULL }, *l, *next, *prev;
+    int i;
+
+    if (be_expand(dict) < 0)
+        return -1;
+    if (dict->type != DICT || REFCNT(dict) > 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (list_empty(head))
+        return 0;
+    head->prev->next = NULL;
+    for (l = head->next; l; l = next) {
+        next = l->next;
+        l->next = NULL;
+        for (i = 0; run[i]; i++) {  // run[i] holds 2^i older entries
+            l = be_dict_merge(run[i], l);
+            run[i] = NULL;
+        }
+        run[i] = l;
+    }
+    for (l = NULL, i = 0; i < 64; i++) {
+        if (run[i])
+            l = be_dict_merge(run[i], l);
+    }
+
+    for (prev = head; l; prev = l, l = l->next) {
+        prev->next = l;
+        l->prev = prev;
+    }
+    prev->next = head;
+    head->prev = prev;
+    return 0;
+}
 int be_dict_add_str(be_node_t *dict, const char *keystr, char *valstr) {
     be_node_t *val = be_alloc(STR);
     if (val == NULL)
         return -1;
     val->x.str.buf = BE_STRDUP(valstr);
     val->x.str.len = strlen(valstr);
-    return be_dict_add(dict, keystr, val);
+    return be_dict_add_own(dict, keystr, val);
 }
 int be_dict_add_str_with_len(be_node_t *dict, const char *keystr, char *valstr, int len) {
     be_node_t *val = be_alloc(STR);
@@ -486,20 +1121,20 @@ int be_dict_add_str_with_len(be_node_t *dict, const char *keystr, char *valstr,
         return -1;
     char *c = BE_MALLOC(len);
     if (c == NULL) {
-        BE_FREE(c);
+        be_free1(val);
         return -1;
     }
     memcpy(c, valstr, len);
     val->x.str.buf = c;
     val->x.str.len = len;
-    return be_dict_add(dict, keystr, val);
+    return be_dict_add_own(dict, keystr, val);
 }
 int be_dict_add_num(be_node_t *dict, const char *keystr, long long int valnum) {
     be_node_t *val = be_alloc(NUM);
     if (val == NULL)
         return -1;
     val->x.num = valnum;
-    return be_dict_add(dict, keystr, val);
+    return be_dict_add_own(dict, keystr, val);
 }
 be_dict_t *be_dict_entry_alloc(void) 
 {
@@ -510,4 +1145,1083 @@ be_dict_t *be_dict_entry_alloc(void)
     return dict_entry;
 }
 
-        
+/*************************/
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define BE_HAVE_SSSE3   // built for SSSE3 and picked at run time
+#endif
+
+#define BE_NODE_ID_LEN 20
+
+static const struct {
+    int idlen, addrlen;
+    int list;           // VALUES: a list of one string per peer
+} be_compact_fmt[] = {
+    [BE_PEERS4]  = { 0, 4, 0 },
+    [BE_PEERS6]  = { 0, 16, 0 },
+    [BE_NODES4]  = { BE_NODE_ID_LEN, 4, 0 },
+    [BE_NODES6]  = { BE_NODE_ID_LEN, 16, 0 },
+    [BE_VALUES4] = { 0, 4, 1 },
+    [BE_VALUES6] = { 0, 16, 1 },
+};
+
+#define PUT16(P,V) do { (P)[0] = (V) >> 8; (P)[1] = (V); } while (0)
+#define PUT32(P,V) do { PUT16(P, (V) >> 16); PUT16((P) + 2, V); } while (0)
+
+#ifdef BE_HAVE_SSSE3
+/* pack 6-byte ipv4 peers 4 at a time, one shuffle per output half;
+   returns how many were packed */
+__attribute__((target("ssse3")))
+static size_t be_pack_peers4_ssse3(uint8_t *out, const uint32_t *addr, const uint16_t *port, size_t n) {
+    const __m128i a_lo = _mm_setr_epi8(3, 2, 1, 0, -1, -1, 7, 6, 5, 4, -1, -1, 11, 10, 9, 8);
+    const __m128i p_lo = _mm_setr_epi8(-1, -1, -1, -1, 1, 0, -1, -1, -1, -1, 3, 2, -1, -1, -1, -1);
+    const __m128i a_hi = _mm_setr_epi8(-1, -1, 15, 14, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i p_hi = _mm_setr_epi8(5, 4, -1, -1, -1, -1, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4, out += 24) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (addr + i));
+        __m128i p = _mm_loadl_epi64((const __m128i *) (port + i));
+        _mm_storeu_si128((__m128i *) out,
+                         _mm_or_si128(_mm_shuffle_epi8(a, a_lo), _mm_shuffle_epi8(p, p_lo)));
+        _mm_storel_epi64((__m128i *) (out + 16),
+                         _mm_or_si128(_mm_shuffle_epi8(a, a_hi), _mm_shuffle_epi8(p, p_hi)));
+    }
+    return i;
+}
+#endif
+
+static void be_pack_peers4(uint8_t *out, const uint32_t *addr, const uint16_t *port, size_t n) {
+    size_t i = 0;
+
+#ifdef BE_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) {
+        i = be_pack_peers4_ssse3(out, addr, port, n);
+        out += i * 6;
+    }
+#endif
+    for (; i < n; i++, out += 6) {
+        PUT32(out, addr[i]);
+        PUT16(out + 4, port[i]);
+    }
+}
+
+#ifdef BE_HAVE_SSSE3
+/* byte-swap ports into network order 8 at a time; returns how many */
+__attribute__((target("ssse3")))
+static size_t be_swap_ports_ssse3(uint8_t *out, const uint16_t *port, size_t n) {
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8, out += 16)
+        _mm_storeu_si128((__m128i *) out,
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (port + i)), swap));
+    return i;
+}
+#endif
+
+static void be_swap_ports(uint8_t *out, const uint16_t *port, size_t n) {
+    size_t i = 0;
+
+#ifdef BE_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+        i = be_swap_ports_ssse3(out, port, n);
+#endif
+    for (; i < n; i++)
+        PUT16(out + 2 * i, port[i]);
+}
+
+/* one entry; port points at its 2 bytes, already in network order */
+static void be_pack_compact(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                            const uint8_t *port, size_t i, uint8_t *out) {
+    int idlen = be_compact_fmt[kind].idlen;
+
+    if (idlen) {
+        memcpy(out, ids + i * idlen, idlen);
+        out += idlen;
+    }
+    if (be_compact_fmt[kind].addrlen == 4) {
+        PUT32(out, ((const uint32_t *) addrs)[i]);
+        out += 4;
+    } else {
+        memcpy(out, (const uint8_t *) addrs + i * 16, 16);
+        out += 16;
+    }
+    memcpy(out, port, 2);
+}
+
+#define BE_PORT_CHUNK 64    // ports swapped per batch, on the stack
+
+/* Pack n entries back to back, each preceded by the plen bytes at pfx
+   (the "18:" of a VALUES list item, or nothing). Entries are not
+   aligned to vectors, so apart from ipv4 peers only the ports are
+   swapped in bulk, a batch at a time. */
+static void be_pack_compact_all(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                                const uint16_t *ports, size_t n, uint8_t *out,
+                                const char *pfx, size_t plen) {
+    size_t i, j, m, elen = be_compact_fmt[kind].idlen + be_compact_fmt[kind].addrlen + 2;
+    uint8_t pbuf[2 * BE_PORT_CHUNK];
+
+    if (kind == BE_PEERS4 && plen == 0) {
+        be_pack_peers4(out, addrs, ports, n);
+        return;
+    }
+    for (i = 0; i < n; i += m) {
+        m = n - i < BE_PORT_CHUNK ? n - i : BE_PORT_CHUNK;
+        be_swap_ports(pbuf, ports + i, m);
+        for (j = 0; j < m; j++, out += plen + elen) {
+            if (plen)
+                memcpy(out, pfx, plen);
+            be_pack_compact(kind, ids, addrs, pbuf + 2 * j, i + j, out + plen);
+        }
+    }
+}
+
+static int be_compact_check(enum be_compact kind, const uint8_t *ids) {
+    if (kind < BE_PEERS4 || kind > BE_VALUES6 ||
+        (be_compact_fmt[kind].idlen != 0) != (ids != NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Encode the compact form as a bencode string (or list, for VALUES)
+   directly into outBuf. As with be_encode(), outBuf == NULL returns the
+   size needed. */
+ssize_t be_encode_compact(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                          const uint16_t *ports, size_t n, char *outBuf, size_t outBufLen) {
+    char tmpBuf[TMPBUFLEN];
+    size_t elen, sz;
+    int hlen;
+
+    if (be_compact_check(kind, ids) < 0)
+        return -1;
+    elen = be_compact_fmt[kind].idlen + be_compact_fmt[kind].addrlen + 2;
+
+    if (be_compact_fmt[kind].list) {
+        hlen = snprintf(tmpBuf, TMPBUFLEN, "%zu:", elen);
+        sz = 2 + n * (hlen + elen);
+        if (outBuf == NULL)
+            return sz;
+        if (sz > outBufLen)
+            return -1;
+        *outBuf = 'l';
+        be_pack_compact_all(kind, ids, addrs, ports, n, (uint8_t *) outBuf + 1, tmpBuf, hlen);
+        outBuf[sz - 1] = 'e';
+        return sz;
+    }
+
+    hlen = snprintf(tmpBuf, TMPBUFLEN, "%zu:", n * elen);
+    sz = hlen + n * elen;
+    if (outBuf == NULL)
+        return sz;
+    if (sz > outBufLen)
+        return -1;
+    memcpy(outBuf, tmpBuf, hlen);
+    be_pack_compact_all(kind, ids, addrs, ports, n, (uint8_t *) outBuf + hlen, NULL, 0);
+    return sz;
+}
+
+/* A node that packs the arrays when it is encoded; the node and its
+   descriptor share one allocation. */
+be_node_t *be_alloc_compact(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                            const uint16_t *ports, size_t n) {
+    be_node_t *ret;
+    be_compact_src_t *src;
+
+    if (be_compact_check(kind, ids) < 0)
+        return NULL;
+    if ((ret = BE_CALLOC(1, sizeof(be_node_t) + sizeof(be_compact_src_t))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STATS_ADD(nodes_created, 1);
+    ret->type = COMPACT;
+    init_list_head(&ret->link);
+    src = ret->x.compact = (be_compact_src_t *) (ret + 1);
+    src->kind = kind;
+    src->ids = ids;
+    src->addrs = addrs;
+    src->ports = ports;
+    src->n = n;
+    return ret;
+}
+
+/* Add a COMPACT value under keystr; nothing is packed until encoding. */
+int be_dict_add_compact(be_node_t *dict, const char *keystr, enum be_compact kind,
+                        const uint8_t *ids, const void *addrs, const uint16_t *ports, size_t n) {
+    be_node_t *val = be_alloc_compact(kind, ids, addrs, ports, n);
+
+    if (val == NULL)
+        return -1;
+    return be_dict_add_own(dict, keystr, val);
+}
+
+/*************************/
+static int be_str_dup(be_str_t *dst, const be_str_t *src) {
+    if ((dst->buf = BE_MALLOC(src->len + 1)) == NULL)
+        return -1;
+    memcpy(dst->buf, src->buf, src->len);
+    dst->buf[src->len] = '\0';
+    dst->len = src->len;
+    return 0;
+}
+
+static int be_freeze1(be_node_t *node) {
+    list_t *l, *tmp;
+
+    if (REFCNT(node) < 0) {     // be_clone() blocks can't be shared
+        errno = EINVAL;
+        return -1;
+    }
+    if (REFCNT(node))   // already frozen, possibly shared
+        return 0;
+    if (be_expand(node) < 0) {  // readers must never expand a shared node
+        errno = ENOMEM;
+        return -1;
+    }
+    switch (node->type) {
+    case LIST:
+        list_for_each_safe(l, tmp, &node->x.list_head) {
+            be_node_t *entry = list_entry(l, be_node_t, link), *ref;
+            if (entry->type == REF)
+                continue;
+            if (be_freeze1(entry) < 0)
+                return -1;
+            if ((ref = be_alloc(REF)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            list_add(&ref->link, &entry->link);  // take entry's place
+            list_del(&entry->link);
+            init_list_head(&entry->link);
+            ref->x.ref = entry;
+        }
+        break;
+    case DICT:
+        list_for_each(l, &node->x.dict_head) {
+            be_dict_t *entry = list_entry(l, be_dict_t, link);
+            if (be_freeze1(entry->val) < 0)
+                return -1;
+        }
+        break;
+    case REF:
+        return be_freeze1(node->x.ref);
+    default:
+        break;
+    }
+    __atomic_store_n(&node->refcnt, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Make the tree rooted at node immutable and return it holding one
+   reference. The root must not be linked into a list; wrap it with
+   be_ref() for that. On failure the tree is left partially frozen but
+   still valid, and the caller should be_free() it. */
+be_node_t *be_freeze(be_node_t *node) {
+    if (node == NULL || node->type == REF || !list_empty(&node->link)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (be_freeze1(node) < 0)
+        return NULL;
+    return node;
+}
+
+be_node_t *be_retain(be_node_t *node) {
+    if (node == NULL || REFCNT(node) <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    __atomic_add_fetch(&node->refcnt, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/* Wrap a reference to a frozen node so it can be linked into a list.
+   The wrapper takes over the caller's reference. */
+be_node_t *be_ref(be_node_t *node) {
+    be_node_t *ret;
+
+    if (node == NULL || REFCNT(node) <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((ret = be_alloc(REF)) == NULL)
+        return NULL;
+    ret->x.ref = node;
+    return ret;
+}
+
+be_node_t *be_deref(be_node_t *node) {
+    while (node && node->type == REF)
+        node = node->x.ref;
+    return node;
+}
+
+/* Shallow mutable copy of a frozen node. The children are shared with
+   the original, so only this one node is cloned. */
+be_node_t *be_thaw(be_node_t *node) {
+    be_node_t *ret, *ref;
+    list_t *l;
+
+    node = be_deref(node);
+    if (node == NULL || REFCNT(node) <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (node->type == COMPACT)
+        return be_alloc_compact(node->x.compact->kind, node->x.compact->ids,
+                                node->x.compact->addrs, node->x.compact->ports,
+                                node->x.compact->n);
+    if ((ret = be_alloc(node->type)) == NULL)
+        goto nomem;
+    switch (node->type) {
+    case STR:
+        if (be_str_dup(&ret->x.str, &node->x.str) < 0)
+            goto nomem;
+        break;
+    case NUM:
+        ret->x.num = node->x.num;
+        break;
+    case LIST:
+        list_for_each(l, &node->x.list_head) {
+            be_node_t *entry = list_entry(l, be_node_t, link);
+            if ((ref = be_ref(be_retain(be_deref(entry)))) == NULL) {
+                be_free1(be_deref(entry));
+                goto nomem;
+            }
+            list_add_tail(&ref->link, &ret->x.list_head);
+        }
+        break;
+    case DICT:
+        list_for_each(l, &node->x.dict_head) {
+            be_dict_t *entry = list_entry(l, be_dict_t, link);
+            be_dict_t *copy = be_dict_entry_alloc();
+            if (copy == NULL)
+                goto nomem;
+            list_add_tail(&copy->link, &ret->x.dict_head);
+            if (be_str_dup(&copy->key, &entry->key) < 0)
+                goto nomem;
+            copy->val = be_retain(entry->val);
+        }
+        break;
+    default:
+        break;
+    }
+    return ret;
+
+nomem:
+    be_free1(ret);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* on failure val is still owned by the caller */
+static be_node_t *be_frozen_set1(be_node_t *root, const char **path, be_node_t *val) {
+    be_node_t *copy, *child;
+    be_dict_t *entry = NULL;
+
+    if (*path == NULL)
+        return val;
+    copy = root ? be_thaw(root) : be_alloc(DICT);
+    if (copy == NULL)
+        return NULL;
+    if (copy->type != DICT) {
+        errno = EINVAL;
+        goto err;
+    }
+    be_dict_lookup(copy, *path, &entry);
+    if (entry == NULL) {
+        if (be_dict_add(copy, *path, NULL) < 0)
+            goto err;
+        be_dict_lookup(copy, *path, &entry);
+    }
+    if ((child = be_frozen_set1(entry->val, path + 1, val)) == NULL)
+        goto err;
+    be_free1(entry->val);
+    entry->val = child;
+    be_freeze1(copy);   // every child is frozen already, so this can't fail
+    return copy;
+
+err:
+    be_free1(copy);
+    return NULL;
+}
+
+/* Copy-on-write update: return a new frozen root in which the value at
+   the dict key path (NULL terminated) is val, creating missing dicts on
+   the way. Only the nodes along the path are copied; everything else is
+   shared with root, which stays valid and unchanged. val is consumed. */
+be_node_t *be_frozen_set(be_node_t *root, const char **path, be_node_t *val) {
+    be_node_t *ret;
+
+    if (REFCNT(val) <= 0 && be_freeze(val) == NULL) {
+        be_free(val);
+        return NULL;
+    }
+    if ((ret = be_frozen_set1(root, path, val)) == NULL)
+        be_free(val);
+    return ret;
+}
+
+/*************************/
+/* be_clone() carves everything out of one block in traversal order. The
+   sizing pass and the copying pass take space through the same helper,
+   so their padding always agrees. */
+static size_t be_take(size_t *off, size_t size, size_t align) {
+    size_t ret = (*off + align - 1) & ~(align - 1);
+    *off = ret + size;
+    return ret;
+}
+
+#define TAKE_NODE(OFF) be_take(OFF, sizeof(be_node_t), __alignof__(be_node_t))
+#define TAKE_DICT(OFF) be_take(OFF, sizeof(be_dict_t), __alignof__(be_dict_t))
+#define TAKE_STR(OFF,S) be_take(OFF, (S)->len + 1, 1)
+#define TAKE_COMPACT(OFF) be_take(OFF, sizeof(be_compact_src_t), __alignof__(be_compact_src_t))
+
+/* A LAZY span's string at buf, pointing into the span. The span was
+   validated when decoded, so none of the raw walkers below check it. */
+static be_str_t be_raw_str(const char *buf, size_t len, size_t *rx) {
+    long long int slen = be_check_str(buf, len, rx);
+    be_str_t ret = { .buf = (char *) buf + *rx - slen, .len = slen };
+    return ret;
+}
+
+static size_t be_clone_size_raw(const char *buf, size_t len, size_t *off) {
+    size_t orglen = len, n;
+    be_str_t str;
+    char type;
+
+    TAKE_NODE(off);
+    switch (*buf) {
+    case 'i':
+        be_decode_int(buf + 1, len - 1, &n);
+        EAT_N(buf, len, n + 2);
+        break;
+    case 'l':
+    case 'd':
+        type = *buf;
+        for (EAT(buf, len); *buf != 'e'; EAT_N(buf, len, n)) {
+            if (type == 'd') {
+                TAKE_DICT(off);
+                str = be_raw_str(buf, len, &n);
+                TAKE_STR(off, &str);
+                EAT_N(buf, len, n);
+            }
+            n = be_clone_size_raw(buf, len, off);
+        }
+        EAT(buf, len);
+        break;
+    default:
+        str = be_raw_str(buf, len, &n);
+        TAKE_STR(off, &str);
+        EAT_N(buf, len, n);
+        break;
+    }
+    return orglen - len;
+}
+
+static void be_clone_size(const be_node_t *node, size_t *off) {
+    list_t *l;
+
+    node = be_deref((be_node_t *) node);
+    if (node->type == LAZY) {
+        be_clone_size_raw(node->x.raw.buf, node->x.raw.len, off);
+        return;
+    }
+    TAKE_NODE(off);
+    switch (node->type) {
+    case STR:
+        TAKE_STR(off, &node->x.str);
+        break;
+    case COMPACT:
+        TAKE_COMPACT(off);
+        break;
+    case LIST:
+        list_for_each(l, &node->x.list_head)
+            be_clone_size(list_entry(l, be_node_t, link), off);
+        break;
+    case DICT:
+        list_for_each(l, &node->x.dict_head) {
+            be_dict_t *entry = list_entry(l, be_dict_t, link);
+            TAKE_DICT(off);
+            TAKE_STR(off, &entry->key);
+            be_clone_size(entry->val, off);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void be_clone_str(be_str_t *dst, const be_str_t *src, char *base, size_t *off) {
+    dst->buf = base + TAKE_STR(off, src);
+    dst->len = src->len;
+    memcpy(dst->buf, src->buf, src->len);
+    dst->buf[src->len] = '\0';
+}
+
+/* decode a LAZY span straight into the block, leaving the source LAZY */
+static be_node_t *be_clone_raw(const char *buf, size_t len, char *base, size_t *off, size_t *rx) {
+    be_node_t *ret = (be_node_t *) (base + TAKE_NODE(off));
+    size_t orglen = len, n;
+    be_str_t str;
+
+    init_list_head(&ret->link);
+    ret->refcnt = BE_CLONE_INNER;
+    switch (*buf) {
+    case 'i':
+        ret->type = NUM;
+        ret->x.num = be_decode_int(buf + 1, len - 1, &n);
+        EAT_N(buf, len, n + 2);
+        break;
+    case 'l':
+        ret->type = LIST;
+        init_list_head(&ret->x.list_head);
+        for (EAT(buf, len); *buf != 'e'; EAT_N(buf, len, n)) {
+            be_node_t *entry = be_clone_raw(buf, len, base, off, &n);
+            list_add_tail(&entry->link, &ret->x.list_head);
+        }
+        EAT(buf, len);
+        break;
+    case 'd':
+        ret->type = DICT;
+        init_list_head(&ret->x.dict_head);
+        for (EAT(buf, len); *buf != 'e'; EAT_N(buf, len, n)) {
+            be_dict_t *copy = (be_dict_t *) (base + TAKE_DICT(off));
+            list_add_tail(&copy->link, &ret->x.dict_head);
+            str = be_raw_str(buf, len, &n);
+            be_clone_str(&copy->key, &str, base, off);
+            EAT_N(buf, len, n);
+            copy->val = be_clone_raw(buf, len, base, off, &n);
+        }
+        EAT(buf, len);
+        break;
+    default:
+        ret->type = STR;
+        str = be_raw_str(buf, len, &n);
+        be_clone_str(&ret->x.str, &str, base, off);
+        EAT_N(buf, len, n);
+        break;
+    }
+    *rx = orglen - len;
+    return ret;
+}
+
+static be_node_t *be_clone1(const be_node_t *node, char *base, size_t *off) {
+    be_node_t *ret;
+    size_t n;
+    list_t *l;
+
+    node = be_deref((be_node_t *) node);
+    if (node->type == LAZY)
+        return be_clone_raw(node->x.raw.buf, node->x.raw.len, base, off, &n);
+    ret = (be_node_t *) (base + TAKE_NODE(off));
+    init_list_head(&ret->link);
+    ret->type = node->type;
+    ret->refcnt = BE_CLONE_INNER;
+    switch (node->type) {
+    case STR:
+        be_clone_str(&ret->x.str, &node->x.str, base, off);
+        break;
+    case NUM:
+        ret->x.num = node->x.num;
+        break;
+    case COMPACT:   // still points at the caller's arrays
+        ret->x.compact = (be_compact_src_t *) (base + TAKE_COMPACT(off));
+        *ret->x.compact = *node->x.compact;
+        break;
+    case LIST:
+        init_list_head(&ret->x.list_head);
+        list_for_each(l, &node->x.list_head) {
+            be_node_t *entry = be_clone1(list_entry(l, be_node_t, link), base, off);
+            list_add_tail(&entry->link, &ret->x.list_head);
+        }
+        break;
+    case DICT:
+        init_list_head(&ret->x.dict_head);
+        list_for_each(l, &node->x.dict_head) {
+            be_dict_t *entry = list_entry(l, be_dict_t, link);
+            be_dict_t *copy = (be_dict_t *) (base + TAKE_DICT(off));
+            list_add_tail(&copy->link, &ret->x.dict_head);
+            be_clone_str(&copy->key, &entry->key, base, off);
+            copy->val = be_clone1(entry->val, base, off);
+        }
+        break;
+    default:
+        break;
+    }
+    return ret;
+}
+
+/* Deep copy of node in a single allocation; be_free() on the returned
+   root releases all of it. REF nodes are resolved, so cloning a frozen
+   tree gives a plain one, and LAZY parts are decoded into the copy
+   without touching node. The clone can be changed like any tree: new
+   entries and values are allocated on their own and freed with the root.
+   Its inner nodes must not be freed on their own or moved elsewhere;
+   drop them with be_dict_free(). */
+be_node_t *be_clone(const be_node_t *node) {
+    be_node_t *ret;
+    size_t size = 0, off = 0;
+    char *base;
+
+    if (node == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    be_clone_size(node, &size);
+    if ((base = BE_MALLOC(size)) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    ret = be_clone1(node, base, &off);
+    BE_ASSERT(off == size && (char *) ret == base);
+    ret->refcnt = BE_CLONE_ROOT;
+    return ret;
+}
+
+/*************************/
+#define BE_CKEY     0x01    // data starts with a key
+#define BE_CINLINE  0x02    // string lives in data
+#define BE_CLONG    0x04    // data holds a be_clong_t, key and string are out of line
+
+typedef struct be_clong {   // for lengths the header can't hold
+    size_t klen, len;
+    char *key;
+} be_clong_t;
+
+#define BE_CLONG_OF(N) ((be_clong_t *) (N)->data)
+
+static inline int be_cinline(size_t len) {
+    return len <= BE_CNODE_INLINE;
+}
+
+static inline size_t be_cklen(const be_cnode_t *node) {
+    return (node->flags & BE_CLONG) ? BE_CLONG_OF(node)->klen : node->klen;
+}
+
+/* one allocation holding the header, the key and a short string */
+static be_cnode_t *be_cnode_alloc(enum be_type type, const char *key, size_t klen,
+                                  const char *str, size_t len) {
+    size_t size = sizeof(be_cnode_t);
+    int flags = 0;
+    be_cnode_t *ret;
+    char *k = NULL;
+
+    if (klen > UINT16_MAX || len > UINT32_MAX)
+        flags |= BE_CLONG;
+    if (flags & BE_CLONG)
+        size += sizeof(be_clong_t);
+    else if (key)
+        size += klen + 1;
+    if (type == STR && !(flags & BE_CLONG) && be_cinline(len))
+        size += len + 1;
+    if ((ret = BE_MALLOC(size)) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    STATS_ADD(nodes_created, 1);
+    ret->next = NULL;
+    ret->x.head = NULL;
+    ret->len = 0;
+    ret->klen = 0;
+    ret->type = type;
+    ret->flags = flags;
+    if (flags & BE_CLONG) {
+        BE_CLONG_OF(ret)->klen = klen;
+        BE_CLONG_OF(ret)->len = 0;
+        BE_CLONG_OF(ret)->key = NULL;
+    }
+    if (key) {
+        ret->flags |= BE_CKEY;
+        if (flags & BE_CLONG) {
+            if ((k = BE_MALLOC(klen + 1)) == NULL) {
+                BE_FREE(ret);
+                errno = ENOMEM;
+                return NULL;
+            }
+            BE_CLONG_OF(ret)->key = k;
+        } else {
+            k = ret->data;
+            ret->klen = klen;
+        }
+        memcpy(k, key, klen);
+        k[klen] = '\0';
+    }
+    if (type == STR) {
+        char *p;
+        if (!(flags & BE_CLONG) && be_cinline(len)) {
+            ret->flags |= BE_CINLINE;
+            p = ret->data + (key ? klen + 1 : 0);
+        } else if ((p = ret->x.buf = BE_MALLOC(len + 1)) == NULL) {
+            if (flags & BE_CLONG)
+                BE_FREE(BE_CLONG_OF(ret)->key);
+            BE_FREE(ret);
+            errno = ENOMEM;
+            return NULL;
+        }
+        memcpy(p, str, len);
+        p[len] = '\0';
+        if (flags & BE_CLONG)
+            BE_CLONG_OF(ret)->len = len;
+        else
+            ret->len = len;
+    }
+    return ret;
+}
+
+void be_cfree(be_cnode_t *node) {
+    be_cnode_t *child, *next;
+
+    if (node == NULL)
+        return;
+    switch (node->type) {
+    case STR:
+        if (!(node->flags & BE_CINLINE))
+            BE_FREE(node->x.buf);
+        break;
+    case LIST:
+    case DICT:
+        for (child = node->x.head; child; child = next) {
+            next = child->next;
+            be_cfree(child);
+        }
+        break;
+    default:
+        break;
+    }
+    if (node->flags & BE_CLONG)
+        BE_FREE(BE_CLONG_OF(node)->key);
+    BE_FREE(node);
+}
+
+const char *be_ckey(const be_cnode_t *node) {
+    if (!(node->flags & BE_CKEY))
+        return NULL;
+    return (node->flags & BE_CLONG) ? BE_CLONG_OF(node)->key : node->data;
+}
+
+const char *be_cstr(const be_cnode_t *node, size_t *len) {
+    if (node == NULL || node->type != STR)
+        return NULL;
+    if (len)
+        *len = (node->flags & BE_CLONG) ? BE_CLONG_OF(node)->len : node->len;
+    if (node->flags & BE_CINLINE)
+        return node->data + ((node->flags & BE_CKEY) ? node->klen + 1 : 0);
+    return node->x.buf;
+}
+
+/* mirrors be_decode1(), keeping errno semantics */
+static be_cnode_t *be_cdecode1(const char *buf, size_t len, size_t *rx, int depth,
+                               const char *key, size_t klen) {
+    size_t orglen = len, n;
+    be_cnode_t *ret = NULL, **tail;
+    long long int slen;
+    const char *k;
+
+    if (depth > BE_MAX_DEPTH) {
+        errno = ELOOP;
+        goto out;
+    }
+    if (len == 0) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    switch (*buf) {
+    case 'i':
+        if ((ret = be_cnode_alloc(NUM, key, klen, NULL, 0)) == NULL)
+            goto out;
+        EAT(buf,len);
+        if (len == 0)
+            goto inval;
+        ret->x.num = be_decode_int(buf, len, &n);
+        EAT_N(buf,len,n);
+        if (len == 0 || *buf != 'e')
+            goto inval;
+        EAT(buf,len);
+        break;
+    case '0'...'9':
+        slen = be_check_str(buf, len, &n);
+        if (slen < 0) {
+            EAT_N(buf,len,n);
+            errno = EINVAL;
+            goto out;
+        }
+        if ((ret = be_cnode_alloc(STR, key, klen, buf + n - slen, slen)) == NULL)
+            goto out;
+        EAT_N(buf,len,n);
+        break;
+    case 'l':
+    case 'd':
+        if ((ret = be_cnode_alloc(*buf == 'l' ? LIST : DICT, key, klen, NULL, 0)) == NULL)
+            goto out;
+        EAT(buf,len);
+        if (len == 0)
+            goto inval;
+        tail = &ret->x.head;
+        while (*buf != 'e') {
+            k = NULL;
+            slen = 0;
+            if (ret->type == DICT) {
+                slen = be_check_str(buf, len, &n);
+                EAT_N(buf,len,n);
+                if (slen < 0)
+                    goto inval;
+                k = buf - slen;
+            }
+            *tail = be_cdecode1(buf, len, &n, depth+1, k, slen);
+            EAT_N(buf,len,n);
+            if (*tail == NULL)
+                goto err;
+            tail = &(*tail)->next;
+            if (len == 0)
+                goto inval;
+        }
+        EAT(buf,len);
+        break;
+    default:
+        errno = EINVAL;
+        goto out;
+    }
+    goto out;
+
+inval:
+    errno = EINVAL;
+err:
+    be_cfree(ret);
+    ret = NULL;
+out:
+    *rx = orglen - len;
+    return ret;
+}
+
+be_cnode_t *be_cdecode(const char *inBuf, size_t inBufLen, size_t *readAmount) {
+    be_cnode_t *ret;
+    STATS_BEGIN(t0);
+
+    ret = be_cdecode1(inBuf, inBufLen, readAmount, 1, NULL, 0);
+    if (ret)
+        STATS_ADD(bytes_decoded, *readAmount);
+    else
+        STATS_ERR(errno);
+    STATS_END(BE_OP_DECODE, t0);
+    return ret;
+}
+
+static ssize_t be_cencode_bytes(const char *buf, size_t len, char *outBuf, size_t outBufLen) {
+    be_str_t str = { .buf = (char *) buf, .len = len };
+    return be_encode_str(&str, outBuf, outBufLen);
+}
+
+static ssize_t be_cencode1(const be_cnode_t *node, char *outBuf, size_t outBufLen) {
+    char tmpBuf[TMPBUFLEN];
+    const be_cnode_t *child;
+    const char *str;
+    size_t len;
+    ssize_t r;
+    int sz = 1;
+
+    if (outBuf && outBufLen == 0)
+        return -1;
+
+    switch (node->type) {
+    case NUM:
+        sz = snprintf(tmpBuf, TMPBUFLEN, "i%llde", node->x.num);
+        if (outBuf != NULL) {
+            if (sz > outBufLen)
+                return -1;
+            memcpy(outBuf, tmpBuf, sz);
+        }
+        break;
+    case STR:
+        str = be_cstr(node, &len);
+        sz = be_cencode_bytes(str, len, outBuf, outBufLen);
+        if (sz < 0)
+            return -1;
+        break;
+    case LIST:
+    case DICT:
+        if (outBuf) {
+            *outBuf = node->type == LIST ? 'l' : 'd';
+            EAT(outBuf, outBufLen);
+        }
+        for (child = node->x.head; child; child = child->next) {
+            if (node->type == DICT) {
+                r = be_cencode_bytes(be_ckey(child), be_cklen(child), outBuf, outBufLen);
+                CHECK_AND_UPDATE;
+            }
+            r = be_cencode1(child, outBuf, outBufLen);
+            CHECK_AND_UPDATE;
+        }
+        if (outBuf) {
+            if (outBufLen == 0)
+                return -1;
+            *outBuf = 'e';
+        }
+        sz++;
+        break;
+    }
+    return sz;
+}
+
+/* when outBuf == NULL, returns outBufLen needed, as be_encode() does */
+ssize_t be_cencode(const be_cnode_t *node, char *outBuf, size_t outBufLen) {
+    ssize_t ret;
+    STATS_BEGIN(t0);
+
+    ret = be_cencode1(node, outBuf, outBufLen);
+    if (outBuf && ret > 0)
+        STATS_ADD(bytes_encoded, ret);
+    STATS_END(BE_OP_ENCODE, t0);
+    return ret;
+}
+
+be_cnode_t *be_cdict_lookup(const be_cnode_t *node, const char *key) {
+    be_cnode_t *ret = NULL, *child;
+    STATS_BEGIN(t0);
+
+    if (node->type == DICT) {
+        for (child = node->x.head; child; child = child->next) {
+            if (strcmp(key, be_ckey(child)) == 0) {
+                ret = child;
+                break;
+            }
+        }
+    }
+    STATS_END(BE_OP_LOOKUP, t0);
+    return ret;
+}
+
+static be_cnode_t *be_cappend(be_cnode_t *parent, const char *keystr, enum be_type type,
+                              const char *str, size_t len) {
+    be_cnode_t *ret, **tail;
+
+    if (parent && (parent->type != LIST && parent->type != DICT)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((parent && parent->type == DICT) != (keystr != NULL)) {
+        errno = EINVAL;     // dict members need a key, others must not have one
+        return NULL;
+    }
+    ret = be_cnode_alloc(type, keystr, keystr ? strlen(keystr) : 0, str, len);
+    if (ret && parent) {
+        for (tail = &parent->x.head; *tail; tail = &(*tail)->next)
+            ;
+        *tail = ret;
+    }
+    return ret;
+}
+
+/* Create a node and append it to parent (NULL for a root). keystr is
+   required when parent is a dict. */
+be_cnode_t *be_cadd(be_cnode_t *parent, const char *keystr, enum be_type type) {
+    if (type != LIST && type != DICT && type != NUM) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return be_cappend(parent, keystr, type, NULL, 0);
+}
+be_cnode_t *be_cadd_str(be_cnode_t *parent, const char *keystr, const char *buf, size_t len) {
+    return be_cappend(parent, keystr, STR, buf, len);
+}
+be_cnode_t *be_cadd_num(be_cnode_t *parent, const char *keystr, long long int num) {
+    be_cnode_t *ret = be_cappend(parent, keystr, NUM, NULL, 0);
+    if (ret)
+        ret->x.num = num;
+    return ret;
+}
+
+/*************************/
+static void be_op_stats_merge(be_op_stats_t *dst, const be_op_stats_t *src) {
+    int i;
+    unsigned long long max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+    if (max_ns > dst->max_ns)
+        dst->max_ns = max_ns;
+    for (i = 0; i < BE_STATS_BUCKETS; i++)
+        dst->hist[i] += __atomic_load_n(&src->hist[i], __ATOMIC_RELAXED);
+}
+
+void be_stats_merge(be_stats_t *dst, const be_stats_t *src) {
+    int i;
+    unsigned long long depth = __atomic_load_n(&src->max_depth, __ATOMIC_RELAXED);
+
+    for (i = 0; i < BE_OP_MAX; i++)
+        be_op_stats_merge(&dst->op[i], &src->op[i]);
+    dst->bytes_decoded += __atomic_load_n(&src->bytes_decoded, __ATOMIC_RELAXED);
+    dst->bytes_encoded += __atomic_load_n(&src->bytes_encoded, __ATOMIC_RELAXED);
+    dst->nodes_created += __atomic_load_n(&src->nodes_created, __ATOMIC_RELAXED);
+    if (depth > dst->max_depth)
+        dst->max_depth = depth;
+    for (i = 0; i < BE_STATS_MAX_ERRNO; i++)
+        dst->errors[i] += __atomic_load_n(&src->errors[i], __ATOMIC_RELAXED);
+}
+
+void be_stats_thread(be_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+#ifdef BE_STATS
+    if (be_stats_self)
+        be_stats_merge(out, &be_stats_self->s);
+#endif
+}
+
+void be_stats_snapshot(be_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+#ifdef BE_STATS
+    be_stats_slot_t *slot;
+
+    pthread_mutex_lock(&be_stats_lock);
+    be_stats_merge(out, &be_stats_retired);
+    for (slot = be_stats_threads; slot; slot = slot->next)
+        be_stats_merge(out, &slot->s);
+    pthread_mutex_unlock(&be_stats_lock);
+#endif
+}
+
+void be_stats_reset(void) {
+#ifdef BE_STATS
+    be_stats_slot_t *slot = be_stats_self;
+    unsigned long long *p;
+
+    if (slot == NULL)
+        return;
+    for (p = (unsigned long long *) &slot->s; p < (unsigned long long *) (&slot->s + 1); p++)
+        STAT_SET(*p, 0);
+#endif
+}
+
+/* one "name value" pair per line, ready for a metrics scraper */
+void be_stats_dump(const be_stats_t *stats) {
+    static const char *opname[BE_OP_MAX] = { "decode", "encode", "lookup", "free" };
+    int i, b;
+
+    for (i = 0; i < BE_OP_MAX; i++) {
+        const be_op_stats_t *o = &stats->op[i];
+        printf("be_%s_count %llu\n", opname[i], o->count);
+        printf("be_%s_ns_total %llu\n", opname[i], o->total_ns);
+        printf("be_%s_ns_max %llu\n", opname[i], o->max_ns);
+        for (b = 0; b < BE_STATS_BUCKETS; b++) {
+            if (o->hist[b] == 0)
+                continue;
+            if (b == BE_STATS_BUCKETS - 1)
+                printf("be_%s_ns_bucket{lt=\"inf\"} %llu\n", opname[i], o->hist[b]);
+            else
+                printf("be_%s_ns_bucket{lt=\"%llu\"} %llu\n",
+                       opname[i], 1ULL << (b + 1), o->hist[b]);
+        }
+    }
+    printf("be_bytes_decoded %llu\n", stats->bytes_decoded);
+    printf("be_bytes_encoded %llu\n", stats->bytes_encoded);
+    printf("be_nodes_created %llu\n", stats->nodes_created);
+    printf("be_max_depth %llu\n", stats->max_depth);
+    for (i = 0; i < BE_STATS_MAX_ERRNO; i++) {
+        if (stats->errors[i])
+            printf("be_errors{errno=\"%d\"} %llu\n", i, stats->errors[i]);
+    }
+}
@@ -14,6 +14,8 @@
 #ifndef BENCODE_H
 #define BENCODE_H
 
+#include <stdint.h>
+
 #include "list.h"
 
 typedef struct be_str { // data encoding of bencode can be anything,
@@ -27,26 +29,59 @@ typedef struct be_dict {
     struct be_node *val;
 } be_dict_t;
 
+enum be_compact { BE_PEERS4, BE_PEERS6, BE_NODES4, BE_NODES6, BE_VALUES4, BE_VALUES6 };
+
+typedef struct be_compact_src { // arrays packed by be_encode(), not copied
+    enum be_compact kind;
+    const uint8_t *ids;
+    const void *addrs;
+    const uint16_t *ports;
+    size_t n;
+} be_compact_src_t;
+
 typedef struct be_node {
     list_t link;
-    enum be_type { STR, NUM, LIST, DICT } type;
+    enum be_type { STR, NUM, LIST, DICT, REF, LAZY, COMPACT } type;
+    int refcnt;         // 0: mutable, > 0: frozen and shared, < 0: be_clone()
     union {
         be_str_t str;
         long long int num;
         list_t list_head;
         list_t dict_head;
+        struct be_node *ref;    // REF: frozen node placed in a list
+        be_str_t raw;           // LAZY: encoded list or dict, not built yet
+        be_compact_src_t *compact;  // COMPACT: peers packed at encode time
     } x;
 } be_node_t;
 
 /** MAIN APIs **/
 extern be_node_t *be_decode(const char *inBuf, size_t inBufLen, size_t *readAmount);
+extern int be_check(const char *inBuf, size_t inBufLen, size_t *readAmount);
+extern be_node_t *be_decode_lazy(const char *inBuf, size_t inBufLen, size_t *readAmount, int levels);
+extern int be_expand(be_node_t *node);
+extern list_t *be_children(be_node_t *node);
+extern list_t *be_child_next(list_t *head, list_t *pos);
 extern ssize_t be_encode(const be_node_t *node, char *outBuf, size_t outBufLen);
+extern ssize_t be_encode_canonical(const be_node_t *node, char *outBuf, size_t outBufLen);
 extern be_node_t *be_alloc(enum be_type type);
+extern be_node_t *be_clone(const be_node_t *node);
 extern void be_free(be_node_t *node);
 extern void be_dump(be_node_t *node);
 
+/* Iterate a list's nodes or a dict's entries (list_entry() them to
+   be_node_t or be_dict_t). NODE and every child the loop reaches are
+   expanded first, so no LAZY node is ever seen; a child that can't be
+   (ENOMEM) comes back LAZY. HEAD is a list_t * holding be_children(NODE),
+   so NODE is evaluated once. A plain list_for_each() is not safe on a
+   lazy tree: x.raw shares memory with the list heads. Nodes decoded by
+   be_decode_lazy() point into inBuf, which must outlive them. */
+#define be_for_each(POS, HEAD, NODE)                                    \
+    for ((HEAD) = be_children(NODE), (POS) = be_child_next(HEAD, (HEAD)->next); \
+         (POS) != (HEAD); (POS) = be_child_next(HEAD, (POS)->next))
+
 /** DICT APIs **/
 extern void be_dict_free(be_dict_t *dict);
+extern int be_dict_del(be_node_t *dict, be_dict_t *entry);
 extern be_node_t *be_dict_lookup(be_node_t *node, const char *key, be_dict_t **dict_entry);
 extern long long int be_dict_lookup_num(be_node_t *node, const char *key);
 extern char *be_dict_lookup_cstr(be_node_t *node, const char *key);
@@ -55,12 +90,121 @@ extern int be_dict_add(be_node_t *dict, const char *keystr, be_node_t *val);
 extern int be_dict_add_str(be_node_t *dict, const char *keystr, char *valstr);
 extern int be_dict_add_str_with_len(be_node_t *dict, const char *keystr, char *valstr, int len);
 extern int be_dict_add_num(be_node_t *dict, const char *keystr, long long int valnum);
+extern int be_dict_add_sorted(be_node_t *dict, const char *keystr, be_node_t *val);
+extern int be_dict_sort(be_node_t *dict);
+
+/** COMPACT PEER APIs **/
+/* Build BEP 23 "peers"/"peers6" strings, BEP 5 "nodes"/"nodes6" strings
+   and "values" lists straight from address arrays. IPv4 addresses and all
+   ports are in host byte order, IPv6 addresses are 16 bytes in network
+   order, node ids are 20 bytes each (NODES only, else NULL).
+   A COMPACT node only points at the arrays and packs them into the
+   be_encode() output, so they must stay valid as long as the node does.
+   It encodes as a string (a list for VALUES) but is not a STR node. */
+extern be_node_t *be_alloc_compact(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                                   const uint16_t *ports, size_t n);
+extern ssize_t be_encode_compact(enum be_compact kind, const uint8_t *ids, const void *addrs,
+                                 const uint16_t *ports, size_t n, char *outBuf, size_t outBufLen);
+extern int be_dict_add_compact(be_node_t *dict, const char *keystr, enum be_compact kind,
+                               const uint8_t *ids, const void *addrs, const uint16_t *ports, size_t n);
+
+/** IMMUTABLE TREE APIs **/
+/* A frozen tree is read-only and may be shared by any number of parents
+   and read from any thread without locking. Children of a frozen list are
+   REF nodes (use be_deref()); frozen dict values are the frozen nodes
+   themselves. be_free() on a frozen node drops one reference. */
+extern be_node_t *be_freeze(be_node_t *node);
+extern be_node_t *be_retain(be_node_t *node);
+extern be_node_t *be_ref(be_node_t *node);
+extern be_node_t *be_deref(be_node_t *node);
+extern be_node_t *be_thaw(be_node_t *node);
+extern be_node_t *be_frozen_set(be_node_t *root, const char **path, be_node_t *val);
+
+/** COMPACT TREE APIs **/
+/* A leaner mutable tree for small messages. A node is a 24-byte header
+   followed by its dict key and, when it fits in BE_CNODE_INLINE bytes,
+   its string, all in one allocation. Children are singly linked, so
+   appending walks the parent's children. Keys over 64KiB and strings
+   over 4GiB are kept out of line, with their lengths after the header. */
+#define BE_CNODE_INLINE 15      // longer strings get their own buffer
+
+typedef struct be_cnode {
+    struct be_cnode *next;      // next sibling
+    union {
+        char *buf;              // STR longer than BE_CNODE_INLINE
+        long long int num;
+        struct be_cnode *head;  // LIST, DICT: first child
+    } x;
+    uint32_t len;               // STR: length, unless BE_CLONG
+    uint16_t klen;              // key length, if a dict member, unless BE_CLONG
+    uint8_t type;               // enum be_type
+    uint8_t flags;
+    char data[];                // key\0, then string\0 if inline
+} be_cnode_t;
+
+extern be_cnode_t *be_cdecode(const char *inBuf, size_t inBufLen, size_t *readAmount);
+extern ssize_t be_cencode(const be_cnode_t *node, char *outBuf, size_t outBufLen);
+extern void be_cfree(be_cnode_t *node);
+extern be_cnode_t *be_cadd(be_cnode_t *parent, const char *keystr, enum be_type type);
+extern be_cnode_t *be_cadd_str(be_cnode_t *parent, const char *keystr, const char *buf, size_t len);
+extern be_cnode_t *be_cadd_num(be_cnode_t *parent, const char *keystr, long long int num);
+extern be_cnode_t *be_cdict_lookup(const be_cnode_t *node, const char *key);
+extern const char *be_ckey(const be_cnode_t *node);
+extern const char *be_cstr(const be_cnode_t *node, size_t *len);
+
+/** STATS APIs **/
+/* Compiled in with -DBE_STATS. Without it the hot paths carry no
+   instrumentation and the calls below just hand back zeroed stats. */
+#define BE_STATS_BUCKETS 32    // latency bucket i counts [2^i, 2^(i+1)) ns
+#define BE_STATS_MAX_ERRNO 64  // larger errno values land in the last slot
+
+enum be_stats_op { BE_OP_DECODE, BE_OP_ENCODE, BE_OP_LOOKUP, BE_OP_FREE, BE_OP_MAX };
+
+typedef struct be_op_stats {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long hist[BE_STATS_BUCKETS];
+} be_op_stats_t;
+
+typedef struct be_stats {
+    be_op_stats_t op[BE_OP_MAX];
+    unsigned long long bytes_decoded;   // input consumed by successful be_decode()
+    unsigned long long bytes_encoded;   // output written by be_encode()
+    unsigned long long nodes_created;
+    unsigned long long max_depth;       // deepest be_decode() nesting seen
+    unsigned long long errors[BE_STATS_MAX_ERRNO]; // be_decode() failures by errno
+} be_stats_t;
+
+extern void be_stats_thread(be_stats_t *out);   // calling thread only
+extern void be_stats_snapshot(be_stats_t *out); // all threads, incl. exited ones
+extern void be_stats_reset(void);               // calling thread only
+extern void be_stats_merge(be_stats_t *dst, const be_stats_t *src);
+extern void be_stats_dump(const be_stats_t *stats);
 
 #define BE_MAX_DEPTH 10 // max depth of composite type (list and dict)
 
+/* allocators may be overridden at build time, e.g. by the benchmark */
+#ifdef BE_MALLOC
+extern void *BE_MALLOC(size_t size);
+#else
 #define BE_MALLOC malloc
+#endif
+#ifdef BE_CALLOC
+extern void *BE_CALLOC(size_t nmemb, size_t size);
+#else
 #define BE_CALLOC calloc
-#define BE_FREE(x) do { if (x) free(x); x = NULL; } while (0)
+#endif
+#ifdef BE_FREE_FN
+extern void BE_FREE_FN(void *ptr);
+#else
+#define BE_FREE_FN free
+#endif
+#define BE_FREE(x) do { if (x) BE_FREE_FN(x); x = NULL; } while (0)
+#ifdef BE_STRDUP
+extern char *BE_STRDUP(const char *s);
+#else
 #define BE_STRDUP strdup
+#endif
 #define BE_ASSERT assert
 #endif
@@ -0,0 +1,114 @@
+/* set ts=4 sw=4 enc=utf-8: -*- Mode: c; tab-width: 4; c-basic-offset:4; coding: utf-8 -*- */
+/*
+ * Copyright 2017 Chul-Woong Yang (cwyang@gmail.com)
+ * Licensed under the Apache License, Version 2.0;
+ * See LICENSE for details.
+ *
+ * bencode_bench.c
+ * 19 October 2026
+ *
+ * Memory and speed of be_node_t vs be_cnode_t trees on small messages.
+ * Built by "make bench", which routes the library's allocations through
+ * the counters below.
+ *
+ */
+
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bencode.h"
+
+static size_t n_alloc, n_free, n_bytes;
+
+void *bench_malloc(size_t size) {
+    void *p = malloc(size);
+    n_alloc++;
+    n_bytes += malloc_usable_size(p);
+    return p;
+}
+void *bench_calloc(size_t nmemb, size_t size) {
+    void *p = calloc(nmemb, size);
+    n_alloc++;
+    n_bytes += malloc_usable_size(p);
+    return p;
+}
+char *bench_strdup(const char *s) {
+    char *p = bench_malloc(strlen(s) + 1);
+    strcpy(p, s);
+    return p;
+}
+void bench_free(void *p) {
+    n_free++;
+    free(p);
+}
+
+#define MSG(S) { S, sizeof(S) - 1 }   // the fixtures hold NUL bytes
+
+static const struct {
+    const char *buf;
+    size_t len;
+} messages[] = {
+    /* KRPC ping, find_node query and response, tracker announce reply */
+    MSG("d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe"),
+    MSG("d1:ad2:id20:abcdefghij01234567896:target20:mnopqrstuvwxyz123456e1:q9:find_node1:t2:aa1:y1:qe"),
+    MSG("d1:rd2:id20:0123456789abcdefghij5:nodes26:0123456789abcdefghij\x0a\x00\x00\x01\x1a\xe1" "e1:t2:aa1:y1:re"),
+    MSG("d8:completei5e10:incompletei2e8:intervali1800e5:peers12:\x0a\x00\x00\x01\x1a\xe1\x0a\x00\x00\x02\x1a\xe1" "e"),
+    { NULL, 0 }
+};
+
+#define ROUNDS 200000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+    size_t len, rx, a0, b0;
+    double t0, t_node, t_cnode;
+    be_node_t *node;
+    be_cnode_t *cnode;
+    int i, m;
+
+    printf("%-10s %18s %18s %16s\n", "message", "node allocs/bytes", "cnode allocs/bytes", "node/cnode ns");
+    for (m = 0; messages[m].buf; m++) {
+        const char *buf = messages[m].buf;
+        size_t node_alloc, node_bytes;
+        len = messages[m].len;
+
+        a0 = n_alloc, b0 = n_bytes;
+        t0 = now();
+        for (i = 0; i < ROUNDS; i++) {
+            node = be_decode(buf, len, &rx);
+            assert(node != NULL && rx == len);  // a bad fixture would time the error path
+            be_free(node);
+        }
+        t_node = now() - t0;
+        node_alloc = n_alloc - a0, node_bytes = n_bytes - b0;
+
+        a0 = n_alloc, b0 = n_bytes;
+        t0 = now();
+        for (i = 0; i < ROUNDS; i++) {
+            cnode = be_cdecode(buf, len, &rx);
+            assert(cnode != NULL && rx == len);
+            be_cfree(cnode);
+        }
+        t_cnode = now() - t0;
+
+        printf("#%-9d %8zu/%-9zu %8zu/%-9zu %7.0f/%-7.0f\n", m,
+               node_alloc / ROUNDS, node_bytes / ROUNDS,
+               (n_alloc - a0) / ROUNDS, (n_bytes - b0) / ROUNDS,
+               t_node / ROUNDS * 1e9, t_cnode / ROUNDS * 1e9);
+    }
+    if (n_free != n_alloc) {
+        printf("%zu allocations not freed\n", n_alloc - n_free);
+        return 1;
+    }
+    return 0;
+}
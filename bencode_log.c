@@ -0,0 +1,469 @@
+/* set ts=4 sw=4 enc=utf-8: -*- Mode: c; tab-width: 4; c-basic-offset:4; coding: utf-8 -*- */
+/*
+ * Copyright 2017 Chul-Woong Yang (cwyang@gmail.com)
+ * Licensed under the Apache License, Version 2.0;
+ * See LICENSE for details.
+ *
+ * bencode_log.c
+ * 19 October 2026
+ *
+ * Append-only logs of back-to-back bencode records
+ *
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bencode_log.h"
+
+static char *be_log_idx_path(const char *path) {
+    char *ret = BE_MALLOC(strlen(path) + sizeof(".idx"));
+
+    if (ret)
+        sprintf(ret, "%s.idx", path);
+    return ret;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = write(fd, p, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Index the log by validating records from the start. Stops at the first
+   record that doesn't parse, so a torn write at the tail is left out. */
+static int be_log_scan(be_log_t *log) {
+    uint64_t *end = NULL, *tmp;
+    size_t off = 0, n, cap = 0;
+
+    log->count = 0;
+    while (off < log->len && be_check(log->buf + off, log->len - off, &n) == 0) {
+        if (log->count == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((tmp = realloc(end, cap * sizeof(uint64_t))) == NULL) {
+                free(end);      // realloc()ed, not BE_MALLOC()ed
+                errno = ENOMEM;
+                return -1;
+            }
+            end = tmp;
+        }
+        off += n;
+        end[log->count++] = off;
+    }
+    log->end = end;
+    log->idx_len = 0;
+    return 0;
+}
+
+/* Map the sidecar index if it describes the whole log. */
+static int be_log_map_idx(be_log_t *log, const char *path) {
+    char *idx_path = be_log_idx_path(path);
+    struct stat st;
+    size_t i;
+    void *p;
+    int fd;
+
+    if (idx_path == NULL)
+        return -1;
+    fd = open(idx_path, O_RDONLY);
+    BE_FREE(idx_path);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size % sizeof(uint64_t)) {
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    log->end = p;
+    log->count = st.st_size / sizeof(uint64_t);
+    for (i = 0; i < log->count; i++)    // offsets rise to exactly the log's end
+        if ((i && log->end[i] < log->end[i-1]) || log->end[i] > log->len)
+            break;
+    if (i < log->count || log->end[log->count - 1] != log->len) {
+        munmap(p, st.st_size);
+        log->end = NULL;
+        log->count = 0;
+        return -1;
+    }
+    log->idx_len = st.st_size;
+    return 0;
+}
+
+be_log_t *be_log_open(const char *path) {
+    be_log_t *log = BE_CALLOC(1, sizeof(be_log_t));
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (log == NULL)
+        return NULL;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        goto err;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        goto err;
+    }
+    log->len = st.st_size;
+    if (log->len > 0) {
+        p = mmap(NULL, log->len, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            goto err;
+        }
+        log->buf = p;
+    }
+    close(fd);
+
+    if (log->len > 0 && be_log_map_idx(log, path) < 0 && be_log_scan(log) < 0)
+        goto err;
+    return log;
+
+err:
+    be_log_close(log);
+    return NULL;
+}
+
+void be_log_close(be_log_t *log) {
+    if (log == NULL)
+        return;
+    if (log->idx_len)
+        munmap((void *) log->end, log->idx_len);
+    else
+        free((void *) log->end);
+    if (log->buf)
+        munmap((void *) log->buf, log->len);
+    BE_FREE(log);
+}
+
+/* O(1) access to the raw bytes of record n */
+const char *be_log_record(const be_log_t *log, size_t n, size_t *len) {
+    size_t start;
+
+    if (n >= log->count) {
+        errno = ERANGE;
+        return NULL;
+    }
+    start = n ? log->end[n-1] : 0;
+    *len = log->end[n] - start;
+    return log->buf + start;
+}
+
+be_node_t *be_log_decode(const be_log_t *log, size_t n) {
+    const char *rec;
+    size_t len, rx;
+
+    if ((rec = be_log_record(log, n, &len)) == NULL)
+        return NULL;
+    return be_decode(rec, len, &rx);
+}
+
+/* Call fn on records [from, to), prefetching a few records ahead. */
+int be_log_foreach(const be_log_t *log, size_t from, size_t to, be_log_fn fn, void *arg) {
+    const char *rec;
+    size_t i, len = 0, start, pgsz = sysconf(_SC_PAGESIZE);
+    int r;
+
+    if (to > log->count)
+        to = log->count;
+    if (from >= to)
+        return 0;
+
+    start = from ? log->end[from-1] : 0;
+    start &= ~(pgsz - 1);
+    madvise((char *) log->buf + start, log->end[to-1] - start, MADV_SEQUENTIAL);
+
+    for (i = from; i < to; i++) {
+        if (i + BE_LOG_PREFETCH < to)
+            __builtin_prefetch(log->buf + log->end[i + BE_LOG_PREFETCH - 1]);
+        rec = be_log_record(log, i, &len);
+        if ((r = fn(rec, len, i, arg)) != 0)
+            return r;
+    }
+    return 0;
+}
+
+typedef struct be_log_job {
+    const be_log_t *log;
+    size_t from, to;
+    be_log_fn fn;
+    void *arg;
+    int ret;
+} be_log_job_t;
+
+static void *be_log_worker(void *arg) {
+    be_log_job_t *job = arg;
+
+    job->ret = be_log_foreach(job->log, job->from, job->to, job->fn, job->arg);
+    return NULL;
+}
+
+/* Split records [from, to) into nthreads contiguous slices and scan them
+   concurrently. fn must be thread-safe. Returns the first nonzero fn()
+   result in record order, or 0. */
+int be_log_parallel(const be_log_t *log, size_t from, size_t to, int nthreads,
+                    be_log_fn fn, void *arg) {
+    be_log_job_t *job;
+    pthread_t *tid;
+    size_t chunk;
+    int i, ret = 0, *started;
+
+    if (to > log->count)
+        to = log->count;
+    if (nthreads <= 1 || from >= to)
+        return be_log_foreach(log, from, to, fn, arg);
+
+    job = BE_CALLOC(nthreads, sizeof(be_log_job_t));
+    tid = BE_CALLOC(nthreads, sizeof(pthread_t));
+    started = BE_CALLOC(nthreads, sizeof(int));
+    if (job == NULL || tid == NULL || started == NULL) {
+        BE_FREE(job);
+        BE_FREE(tid);
+        BE_FREE(started);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    chunk = (to - from + nthreads - 1) / nthreads;
+    for (i = 0; i < nthreads; i++) {
+        job[i].log = log;
+        job[i].from = from + i * chunk < to ? from + i * chunk : to;
+        job[i].to = job[i].from + chunk < to ? job[i].from + chunk : to;
+        job[i].fn = fn;
+        job[i].arg = arg;
+        started[i] = pthread_create(&tid[i], NULL, be_log_worker, &job[i]) == 0;
+        if (!started[i])    // run it here rather than fail the scan
+            be_log_worker(&job[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (started[i])
+            pthread_join(tid[i], NULL);
+        if (ret == 0)
+            ret = job[i].ret;
+    }
+
+    BE_FREE(job);
+    BE_FREE(tid);
+    BE_FREE(started);
+    return ret;
+}
+
+/*************************/
+/* Skip the string at buf[*i]: 1 if buf ends inside it, 0 past it, -1 if
+   it isn't one. */
+static int be_log_skip_str(const char *buf, size_t len, size_t *i) {
+    uint64_t slen = 0;
+
+    if (!isdigit((unsigned char) buf[*i]))
+        return -1;
+    while (*i < len && isdigit((unsigned char) buf[*i]))
+        slen = slen * 10 + (buf[(*i)++] - '0');
+    if (*i == len)
+        return 1;
+    if (buf[(*i)++] != ':')
+        return -1;
+    if (len - *i < slen)
+        return 1;
+    *i += slen;
+    return 0;
+}
+
+/* Is buf the start of a bencode value cut short by the end of input, as a
+   torn write leaves it? Any depth is accepted: a complete record, even one
+   be_check() rejects, is never taken for a torn one. */
+static int be_log_torn(const char *buf, size_t len) {
+    char *stack = BE_MALLOC(len);   // 'l', or 'd'/'v' for a dict wanting a key/value
+    size_t i = 0, top = 0;
+    int ret = 0, r;
+
+    if (stack == NULL)
+        return 0;
+    while (i < len) {
+        if (top && buf[i] == 'e' && stack[top-1] != 'v') {
+            i++, top--;
+        } else if (top && stack[top-1] == 'd') {
+            if ((r = be_log_skip_str(buf, len, &i)) != 0) {
+                ret = r > 0;
+                goto out;
+            }
+            stack[top-1] = 'v';
+            continue;
+        } else if (buf[i] == 'l' || buf[i] == 'd') {
+            stack[top++] = buf[i++];
+            continue;
+        } else if (buf[i] == 'i') {
+            i++;
+            if (i < len && buf[i] == '-')
+                i++;
+            while (i < len && isdigit((unsigned char) buf[i]))
+                i++;
+            if (i == len)
+                break;
+            if (buf[i++] != 'e')
+                goto out;
+        } else if ((r = be_log_skip_str(buf, len, &i)) != 0) {
+            ret = r > 0;
+            goto out;
+        }
+        if (top == 0)   // a whole value
+            goto out;
+        if (stack[top-1] == 'v')
+            stack[top-1] = 'd';
+    }
+    ret = 1;
+out:
+    BE_FREE(stack);
+    return ret;
+}
+
+/* Drop a torn record at the tail and rewrite the index when it doesn't
+   match the log, e.g. after a crash between the two writes. Anything else
+   after the last valid record is left alone and the open fails. */
+static int be_log_repair(be_log_writer_t *w, const char *path, const char *idx_path) {
+    be_log_t *log;
+    struct stat st;
+    size_t good;
+    int ret = -1;
+
+    if (fstat(w->idx_fd, &st) < 0)
+        return -1;
+    if (w->off == 0 && st.st_size == 0)   // fresh log
+        return 0;
+    if ((log = be_log_open(path)) == NULL)
+        return -1;
+    if (log->idx_len)   // index matched the log
+        goto ok;
+
+    good = log->count ? log->end[log->count - 1] : 0;
+    if (good != w->off && !be_log_torn(log->buf + good, w->off - good)) {
+        errno = EINVAL;
+        goto out;
+    }
+    if (good != w->off && ftruncate(w->fd, good) < 0)
+        goto out;
+    w->off = good;
+    close(w->idx_fd);
+    w->idx_fd = open(idx_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (w->idx_fd < 0 || write_all(w->idx_fd, log->end, log->count * sizeof(uint64_t)) < 0)
+        goto out;
+ok:
+    ret = 0;
+out:
+    be_log_close(log);
+    return ret;
+}
+
+be_log_writer_t *be_log_writer_open(const char *path) {
+    be_log_writer_t *w = BE_CALLOC(1, sizeof(be_log_writer_t));
+    char *idx_path = be_log_idx_path(path);
+    off_t off;
+
+    if (w == NULL || idx_path == NULL)
+        goto err;
+    w->fd = w->idx_fd = -1;
+    if ((w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        goto err;
+    if ((w->idx_fd = open(idx_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        goto err;
+    if ((off = lseek(w->fd, 0, SEEK_END)) < 0)
+        goto err;
+    w->off = off;
+    if (be_log_repair(w, path, idx_path) < 0)
+        goto err;
+    BE_FREE(idx_path);
+    return w;
+
+err:
+    if (w && w->fd >= 0)
+        close(w->fd);
+    if (w && w->idx_fd >= 0)
+        close(w->idx_fd);
+    BE_FREE(w);
+    BE_FREE(idx_path);
+    return NULL;
+}
+
+/* A record that fails to write is cut back off, so the next append still
+   lands where the index says; if even that fails the writer gives up.
+   Once the record is written, a failed index write leaves it in the log
+   (reopening rebuilds the index), so retrying the append stores it twice. */
+static int be_log_write(be_log_writer_t *w, const char *buf, size_t len) {
+    int err;
+
+    if (w->broken) {
+        errno = EIO;
+        return -1;
+    }
+    if (write_all(w->fd, buf, len) < 0) {
+        err = errno;
+        if (ftruncate(w->fd, w->off) < 0)
+            w->broken = 1;
+        errno = err;
+        return -1;
+    }
+    w->off += len;
+    return write_all(w->idx_fd, &w->off, sizeof(w->off));
+}
+
+/* buf must hold exactly one bencode value that be_log_open() can read back */
+int be_log_append_raw(be_log_writer_t *w, const char *buf, size_t len) {
+    size_t rx;
+
+    if (be_check(buf, len, &rx) < 0 || rx != len) {
+        errno = EINVAL;
+        return -1;
+    }
+    return be_log_write(w, buf, len);
+}
+
+int be_log_append(be_log_writer_t *w, const be_node_t *node) {
+    ssize_t n = be_encode(node, NULL, 0);
+    char *buf;
+    int ret;
+
+    if (n < 0)
+        return -1;
+    if ((buf = BE_MALLOC(n)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ret = be_encode(node, buf, n) == n ? be_log_append_raw(w, buf, n) : -1;
+    BE_FREE(buf);
+    return ret;
+}
+
+int be_log_writer_close(be_log_writer_t *w) {
+    int ret = 0;
+
+    if (w == NULL)
+        return 0;
+    if (close(w->fd) < 0)
+        ret = -1;
+    if (close(w->idx_fd) < 0)
+        ret = -1;
+    BE_FREE(w);
+    return ret;
+}
@@ -0,0 +1,62 @@
+/* set ts=4 sw=4 enc=utf-8: -*- Mode: c; tab-width: 4; c-basic-offset:4; coding: utf-8 -*- */
+/*
+ * Copyright 2017 Chul-Woong Yang (cwyang@gmail.com)
+ * Licensed under the Apache License, Version 2.0;
+ * See LICENSE for details.
+ *
+ * bencode_log.h
+ * 19 October 2026
+ *
+ * Append-only logs of back-to-back bencode records
+ *
+ */
+
+#ifndef BENCODE_LOG_H
+#define BENCODE_LOG_H
+
+#include <stdint.h>
+
+#include "bencode.h"
+
+/* A log is a file of concatenated bencode values. Its sidecar "<path>.idx"
+   holds one uint64_t per record, in host byte order: the offset just past
+   that record. Logs without a usable index are indexed by scanning. */
+
+typedef struct be_log_writer {
+    int fd, idx_fd;
+    uint64_t off;       // end of the last record
+    int broken;         // a torn record couldn't be removed; appends fail
+} be_log_writer_t;
+
+typedef struct be_log {
+    const char *buf;    // mmap of the log
+    size_t len;
+    const uint64_t *end;    // end[n]: offset past record n
+    size_t count;
+    size_t idx_len;     // mapped index size, 0 when built by scanning
+} be_log_t;
+
+/* return nonzero to stop the iteration; that value is returned */
+typedef int (*be_log_fn)(const char *rec, size_t len, size_t n, void *arg);
+
+/** WRITER APIs **/
+/* An append that fails before the record is fully written leaves the log
+   unchanged. One that fails on the index write has still stored the
+   record, so retrying it writes the record twice. */
+extern be_log_writer_t *be_log_writer_open(const char *path);
+extern int be_log_append(be_log_writer_t *w, const be_node_t *node);
+extern int be_log_append_raw(be_log_writer_t *w, const char *buf, size_t len);
+extern int be_log_writer_close(be_log_writer_t *w);
+
+/** READER APIs **/
+extern be_log_t *be_log_open(const char *path);
+extern void be_log_close(be_log_t *log);
+extern const char *be_log_record(const be_log_t *log, size_t n, size_t *len);
+extern be_node_t *be_log_decode(const be_log_t *log, size_t n);
+extern int be_log_foreach(const be_log_t *log, size_t from, size_t to, be_log_fn fn, void *arg);
+extern int be_log_parallel(const be_log_t *log, size_t from, size_t to, int nthreads,
+                           be_log_fn fn, void *arg);
+
+#define BE_LOG_PREFETCH 4   // records fetched ahead by be_log_foreach()
+
+#endif
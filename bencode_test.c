@@ -12,13 +12,20 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include "bencode.h"
+#include "bencode_log.h"
 
 const char *sample="d4:testl4:teste8:announce35:udp://tracker.openbittorrent.com:8013:creation datei1327049827e4:infod6:lengthi20e4:name10:sample.txt12:piece lengthi65536e6:pieces20:..R....x...d.......17:privatei1eee";
 
@@ -65,10 +72,11 @@ enum check_type { STRICT, LOOSE };
 
 static void should_pass(const char *c, enum check_type type) 
 {
-    be_node_t *node;
-    size_t len = strlen(c), rx;
+    be_node_t *node, *clone;
+    be_cnode_t *cnode;
+    size_t len = strlen(c), rx, chk;
     ssize_t n, n2;
-    char *buf;
+    char *buf, *cbuf;
 
     printf("<%s>\n", c);
     
@@ -76,6 +84,7 @@ static void should_pass(const char *c, enum check_type type)
     BE_ASSERT(node != NULL);
     if (type == STRICT)
         BE_ASSERT(len == rx); // should consume all
+    BE_ASSERT(be_check(c, len, &chk) == 0 && chk == rx);
 
     n = be_encode(node, NULL, 0);
     if (type == STRICT)
@@ -91,6 +100,32 @@ static void should_pass(const char *c, enum check_type type)
 
     BE_FREE(buf);
     be_free(node);
+
+    cnode = be_cdecode(c, len, &chk);
+    BE_ASSERT(cnode != NULL && chk == rx);
+    BE_ASSERT(be_cencode(cnode, NULL, 0) == n);
+    buf = BE_MALLOC(n+1);
+    BE_ASSERT(be_cencode(cnode, buf, n) == n);
+    if (type == STRICT)
+        BE_ASSERT(strncmp(c, buf, len) == 0);
+    BE_FREE(buf);
+    be_cfree(cnode);
+
+    node = be_decode_lazy(c, len, &chk, 1);
+    BE_ASSERT(node != NULL && chk == rx);
+    clone = be_clone(node);     // decodes the LAZY parts into the clone
+    BE_ASSERT(clone != NULL);
+    BE_ASSERT(be_encode(node, NULL, 0) == n);
+    buf = BE_MALLOC(n+1);
+    BE_ASSERT(be_encode(node, buf, n) == n);
+    if (type == STRICT)
+        BE_ASSERT(strncmp(c, buf, len) == 0);
+    cbuf = BE_MALLOC(n+1);
+    BE_ASSERT(be_encode(clone, cbuf, n) == n && memcmp(buf, cbuf, n) == 0);
+    BE_FREE(cbuf);
+    BE_FREE(buf);
+    be_free(clone);
+    be_free(node);
 }
 
 static void should_fail(const char *c) 
@@ -102,6 +137,9 @@ static void should_fail(const char *c)
 
     node = be_decode(c, len, &rx);
     BE_ASSERT(node == NULL);
+    BE_ASSERT(be_check(c, len, &rx) == -1);
+    BE_ASSERT(be_cdecode(c, len, &rx) == NULL);
+    BE_ASSERT(be_decode_lazy(c, len, &rx, 1) == NULL);
 }
 
 static void gen_dict_bt_resp() 
@@ -150,6 +188,597 @@ static void gen_dict_bt_resp()
     be_free(node);
 }
 
+static char *encode_alloc(const be_node_t *node) 
+{
+    ssize_t n = be_encode(node, NULL, 0);
+    char *buf = BE_MALLOC(n+1);
+
+    BE_ASSERT(buf != NULL);
+    BE_ASSERT(be_encode(node, buf, n) == n);
+    buf[n] = '\0';
+    return buf;
+}
+
+static void test_compact() 
+{
+    uint32_t v4[5];
+    uint16_t port[5];
+    uint8_t v6[2][16], ids[2][20], big_v6[70][16], big[1500];
+    uint16_t big_port[70];
+    char buf[256], *c;
+    be_node_t *node, *clone;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        v4[i] = 0x0a000001 + i;
+        port[i] = 6881 + i;
+    }
+    memset(v6, 0xfe, sizeof(v6));
+    memset(ids, 'N', sizeof(ids));
+
+    n = be_encode_compact(BE_PEERS4, NULL, v4, port, 5, NULL, 0);
+    BE_ASSERT(n == 33);
+    BE_ASSERT(be_encode_compact(BE_PEERS4, NULL, v4, port, 5, buf, n - 1) == -1);
+    BE_ASSERT(be_encode_compact(BE_PEERS4, NULL, v4, port, 5, buf, n) == n);
+    BE_ASSERT(memcmp(buf, "30:", 3) == 0);
+    for (i = 0; i < 5; i++)
+        BE_ASSERT(memcmp(buf + 3 + 6 * i, "\x0a\x00\x00", 3) == 0 &&
+                  buf[3 + 6 * i + 3] == 1 + i &&
+                  memcmp(buf + 3 + 6 * i + 4, "\x1a", 1) == 0 &&
+                  (uint8_t) buf[3 + 6 * i + 5] == 0xe1 + i);
+
+    n = be_encode_compact(BE_NODES4, (uint8_t *) ids, v4, port, 2, buf, sizeof(buf));
+    BE_ASSERT(n == 55 && memcmp(buf, "52:NNNN", 7) == 0);
+    BE_ASSERT(memcmp(buf + 23, "\x0a\x00\x00\x01\x1a\xe1", 6) == 0);
+    BE_ASSERT(be_encode_compact(BE_NODES4, NULL, v4, port, 2, buf, sizeof(buf)) == -1);
+
+    n = be_encode_compact(BE_VALUES6, NULL, v6, port, 2, buf, sizeof(buf));
+    BE_ASSERT(n == 2 + 2 * 21 && memcmp(buf, "l18:\xfe", 5) == 0 && buf[n-1] == 'e');
+
+    /* ports are swapped in batches: cover the vector loop, its tail and
+       more than one batch */
+    for (i = 0; i < 70; i++) {
+        big_port[i] = 0x1a00 + i;
+        memset(big_v6[i], i, 16);
+    }
+    n = be_encode_compact(BE_PEERS6, NULL, big_v6, big_port, 70, (char *) big, sizeof(big));
+    BE_ASSERT(n == 5 + 70 * 18 && memcmp(big, "1260:", 5) == 0);
+    for (i = 0; i < 70; i++)
+        BE_ASSERT(big[5 + 18 * i] == i && big[5 + 18 * i + 16] == 0x1a &&
+                  big[5 + 18 * i + 17] == i);
+    n = be_encode_compact(BE_VALUES6, NULL, big_v6, big_port, 70, (char *) big, sizeof(big));
+    BE_ASSERT(n == 2 + 70 * 21 && big[n-1] == 'e');
+    for (i = 0; i < 70; i++)
+        BE_ASSERT(memcmp(big + 1 + 21 * i, "18:", 3) == 0 && big[1 + 21 * i + 3] == i &&
+                  big[1 + 21 * i + 20] == i);
+
+    node = be_alloc(DICT);
+    BE_ASSERT(be_dict_add_compact(node, "peers", BE_PEERS4, NULL, v4, port, 5) == 0);
+    BE_ASSERT(be_dict_add_compact(node, "peers6", BE_PEERS6, NULL, v6, port, 2) == 0);
+    BE_ASSERT(be_dict_add_compact(node, "values", BE_VALUES4, NULL, v4, port, 2) == 0);
+    c = encode_alloc(node);
+    n = 0;
+#define APPEND(S) memcpy(buf + n, S, strlen(S)), n += strlen(S)
+    APPEND("d5:peers");
+    n += be_encode_compact(BE_PEERS4, NULL, v4, port, 5, buf + n, sizeof(buf) - n);
+    APPEND("6:peers6");
+    n += be_encode_compact(BE_PEERS6, NULL, v6, port, 2, buf + n, sizeof(buf) - n);
+    APPEND("6:values");
+    n += be_encode_compact(BE_VALUES4, NULL, v4, port, 2, buf + n, sizeof(buf) - n);
+    APPEND("e");
+    BE_ASSERT(be_encode(node, NULL, 0) == n && memcmp(c, buf, n) == 0);
+    BE_FREE(c);
+
+    /* packed at encode time, so later changes to the arrays show up */
+    BE_ASSERT(be_dict_lookup(node, "peers", NULL)->type == COMPACT);
+    v4[4] = 0x7f000001;
+    clone = be_clone(node);
+    c = encode_alloc(clone);
+    BE_ASSERT(memcmp(c + 8 + 3 + 24, "\x7f\x00\x00\x01", 4) == 0);
+    BE_FREE(c);
+    be_free(clone);
+    be_free(node);
+}
+
+static void test_canonical() 
+{
+    const char *unsorted = "d1:bi2e1:ai1e2:aai3e1:bi9e1:ld1:zi0e1:yi0eee";
+    const char *sorted = "d1:ai1e2:aai3e1:bi2e1:ld1:yi0e1:zi0eee";
+    be_node_t *node;
+    char buf[64], *c;
+    size_t rx;
+    ssize_t n;
+    list_t *l;
+    int i;
+
+    node = be_decode(unsorted, strlen(unsorted), &rx);
+    BE_ASSERT(node != NULL);
+    n = be_encode_canonical(node, NULL, 0);
+    BE_ASSERT(n == strlen(sorted));
+    BE_ASSERT(be_encode_canonical(node, buf, n - 1) == -1);
+    BE_ASSERT(be_encode_canonical(node, buf, n) == n);
+    BE_ASSERT(memcmp(buf, sorted, n) == 0);
+
+    /* sorting in place keeps the first of duplicate keys in front */
+    BE_ASSERT(be_dict_sort(node) == 0);
+    BE_ASSERT(be_dict_lookup_num(node, "b") == 2);
+    BE_ASSERT(be_encode_canonical(node, buf, n) == n && memcmp(buf, sorted, n) == 0);
+    be_free(node);
+
+    node = be_alloc(DICT);
+    BE_ASSERT(be_dict_add_sorted(node, "l", be_decode("d1:yi0e1:zi0ee", 14, &rx)) == 0);
+    BE_ASSERT(be_dict_add_sorted(node, "b", be_decode("i2e", 3, &rx)) == 0);
+    BE_ASSERT(be_dict_add_sorted(node, "aa", be_decode("i3e", 3, &rx)) == 0);
+    BE_ASSERT(be_dict_add_sorted(node, "a", be_decode("i1e", 3, &rx)) == 0);
+    BE_ASSERT(be_dict_add_sorted(node, "a", NULL) == -1 && errno == EEXIST);
+    BE_ASSERT(be_encode(node, buf, n) == n && memcmp(buf, sorted, n) == 0);
+    be_free(node);
+
+    node = be_alloc(DICT);
+    for (i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "k%03d", (i * 7919) % 1000);
+        be_dict_add_num(node, buf, i);
+    }
+    BE_ASSERT(be_dict_sort(node) == 0);
+    i = 0;
+    list_for_each(l, &node->x.dict_head) {
+        snprintf(buf, sizeof(buf), "k%03d", i++);
+        BE_ASSERT(strcmp(list_entry(l, be_dict_t, link)->key.buf, buf) == 0);
+    }
+    BE_ASSERT(i == 1000 && node->x.dict_head.prev->next == &node->x.dict_head);
+    be_free(node);
+
+    /* nested unsorted dicts: each level is encoded once, not once per
+       ancestor, or this would take 2^40 steps */
+    node = be_alloc(DICT);
+    for (i = 0; i < 40; i++) {
+        be_node_t *parent = be_alloc(DICT);
+        be_dict_add_num(parent, "b", 0);
+        be_dict_add(parent, "a", node);
+        node = parent;
+    }
+    n = be_encode_canonical(node, NULL, 0);
+    BE_ASSERT(n == 40 * 11 + 2);
+    c = malloc(n);
+    BE_ASSERT(be_encode_canonical(node, c, n) == n);
+    BE_ASSERT(memcmp(c, "d1:ad1:a", 8) == 0 && memcmp(c + 40 * 4, "de1:bi0ee", 9) == 0);
+    free(c);
+    be_free(node);
+}
+
+#define FROZEN_THREADS 4
+
+static void *frozen_reader(void *arg) 
+{
+    be_node_t *shared = arg, *mine, *info;
+    char *c;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        mine = be_retain(shared);
+        info = be_dict_lookup(mine, "info", NULL);
+        BE_ASSERT(be_dict_lookup_num(info, "length") == 20);
+        c = encode_alloc(mine);
+        BE_ASSERT(strcmp(c, sample) == 0);
+        BE_FREE(c);
+        be_free(mine);
+    }
+    be_free(shared);    // drop the reference handed over by the spawner
+    return NULL;
+}
+
+/* lock-free readers share one frozen tree and race on its refcount */
+static void test_frozen_threads() 
+{
+    pthread_t tid[FROZEN_THREADS];
+    be_node_t *root;
+    size_t rx;
+    int i;
+
+    root = be_decode(sample, strlen(sample), &rx);
+    BE_ASSERT(be_freeze(root) == root);
+    for (i = 0; i < FROZEN_THREADS; i++)
+        BE_ASSERT(pthread_create(&tid[i], NULL, frozen_reader, be_retain(root)) == 0);
+    be_free(root);
+    for (i = 0; i < FROZEN_THREADS; i++)
+        pthread_join(tid[i], NULL);
+}
+
+static void test_frozen() 
+{
+    const char *peers_str = "l6:\x0a\x00\x00\x01\x1a\xe2" "6:\x0a\x00\x00\x02\x1a\xe2" "e";
+    const char *path[] = { "info", "name", NULL };
+    be_node_t *peers, *resp1, *resp2, *list, *root, *root2;
+    be_dict_t *entry;
+    char *c;
+    size_t rx;
+
+    peers = be_decode(peers_str, 18, &rx);
+    BE_ASSERT(peers != NULL);
+    BE_ASSERT(be_freeze(peers) == peers);
+    BE_ASSERT(be_deref(list_entry(peers->x.list_head.next, be_node_t, link))->type == STR);
+
+    /* share one frozen peer list between two responses */
+    resp1 = be_alloc(DICT);
+    resp2 = be_alloc(DICT);
+    list = be_alloc(LIST);
+    be_dict_add_num(resp1, "interval", 1800);
+    be_dict_add(resp1, "peers", be_retain(peers));
+    be_dict_add(resp2, "peers", be_retain(peers));
+    list_add_tail(&be_ref(be_retain(peers))->link, &list->x.list_head);
+    be_dict_add(resp2, "all", list);
+    be_free(peers);             // responses hold the remaining references
+    BE_ASSERT(peers->refcnt == 3);
+
+    c = encode_alloc(resp1);
+    BE_ASSERT(memcmp(c, "d8:intervali1800e5:peers", 24) == 0 && memcmp(c + 24, peers_str, 18) == 0);
+    BE_FREE(c);
+    c = encode_alloc(resp2);
+    BE_ASSERT(memcmp(c, "d5:peers", 8) == 0 && memcmp(c + 8, peers_str, 18) == 0);
+    BE_FREE(c);
+    BE_ASSERT(be_dict_lookup(resp1, "peers", &entry) == peers);
+    BE_ASSERT(be_dict_del(resp1, entry) == 0 && peers->refcnt == 2);
+    BE_ASSERT(be_dict_lookup(resp1, "interval", &entry) != NULL);
+    be_dict_free(entry);
+    BE_ASSERT(be_dict_lookup(resp1, "interval", NULL) == NULL);
+    be_free(resp1);
+    be_free(resp2);
+
+    /* copy-on-write update shares untouched subtrees */
+    root = be_decode(sample, strlen(sample), &rx);
+    BE_ASSERT(be_freeze(root) == root);
+    BE_ASSERT(be_dict_add_num(root, "x", 1) == -1 && errno == EPERM);
+    BE_ASSERT(be_dict_lookup(root, "test", &entry) != NULL);
+    BE_ASSERT(be_dict_del(root, entry) == -1 && errno == EPERM);
+    root2 = be_frozen_set(root, path, be_decode("3:new", 5, &rx));
+    BE_ASSERT(root2 != NULL && root2 != root);
+    BE_ASSERT(strcmp(be_dict_lookup_cstr(be_dict_lookup(root, "info", NULL), "name"), "sample.txt") == 0);
+    BE_ASSERT(strcmp(be_dict_lookup_cstr(be_dict_lookup(root2, "info", NULL), "name"), "new") == 0);
+    BE_ASSERT(be_dict_lookup(root, "test", NULL) == be_dict_lookup(root2, "test", NULL));
+    BE_ASSERT(be_dict_lookup(root, "info", NULL) != be_dict_lookup(root2, "info", NULL));
+    be_free(root);
+    c = encode_alloc(root2);
+    BE_ASSERT(strstr(c, "4:name3:new") != NULL);
+    BE_FREE(c);
+    be_free(root2);
+}
+
+static void test_clone() 
+{
+    be_node_t *node, *clone, *list, *info, *num;
+    be_dict_t *entry;
+    char *c;
+    size_t rx;
+
+    node = be_decode(sample, strlen(sample), &rx);
+    clone = be_clone(node);
+    BE_ASSERT(clone != NULL && clone != node);
+    be_free(node);
+    c = encode_alloc(clone);
+    BE_ASSERT(strcmp(c, sample) == 0);
+    BE_FREE(c);
+    BE_ASSERT(be_freeze(clone) == NULL && errno == EINVAL);
+    BE_ASSERT(strcmp(be_dict_lookup_cstr(be_dict_lookup(clone, "info", NULL), "name"), "sample.txt") == 0);
+
+    /* fill in the copy: additions are allocated apart from the block */
+    info = be_dict_lookup(clone, "info", NULL);
+    BE_ASSERT(be_dict_add_num(clone, "x", 1) == 0);
+    BE_ASSERT(be_dict_add_num(info, "z", 7) == 0);
+    num = be_alloc(NUM);
+    num->x.num = 5;
+    list_add_tail(&num->link, &be_dict_lookup(clone, "test", NULL)->x.list_head);
+    BE_ASSERT(be_dict_lookup(clone, "creation date", &entry) != NULL);
+    BE_ASSERT(be_dict_del(clone, entry) == 0);     // replace a value in the block
+    BE_ASSERT(be_dict_add_num(clone, "creation date", 2) == 0);
+    BE_ASSERT(be_dict_lookup(clone, "x", &entry) != NULL);
+    be_dict_free(entry);                            // and one added later
+    BE_ASSERT(be_dict_add(clone, "y", info) == -1 && errno == EINVAL);
+    BE_ASSERT(be_dict_lookup_num(clone, "creation date") == 2);
+    BE_ASSERT(be_dict_lookup_num(info, "z") == 7 && be_dict_lookup(clone, "x", NULL) == NULL);
+    c = encode_alloc(clone);
+    BE_ASSERT(strncmp(c, "d4:testl4:testi5ee8:announce", 28) == 0);
+    BE_ASSERT(strstr(c, "1:zi7ee13:creation datei2ee") != NULL);
+    BE_FREE(c);
+
+    /* a clone may hang off a mutable tree, and REFs are resolved */
+    list = be_alloc(LIST);
+    list_add_tail(&clone->link, &list->x.list_head);
+    BE_ASSERT(be_freeze(list) == NULL);     // clones can't be shared
+    node = be_decode("ll1:ai1eee", 10, &rx);
+    BE_ASSERT(be_freeze(node) == node);
+    clone = be_clone(node);
+    be_free(node);
+    BE_ASSERT(list_entry(clone->x.list_head.next, be_node_t, link)->type == LIST);
+    c = encode_alloc(clone);
+    BE_ASSERT(strcmp(c, "ll1:ai1eee") == 0);
+    BE_FREE(c);
+    list_add_tail(&clone->link, &list->x.list_head);
+    be_free(list);
+}
+
+static int count_peers(const char *rec, size_t len, size_t n, void *arg) 
+{
+    be_node_t *node;
+    size_t rx;
+
+    node = be_decode(rec, len, &rx);
+    BE_ASSERT(node != NULL && rx == len);
+    BE_ASSERT(be_dict_lookup_num(node, "seq") == n);
+    __atomic_add_fetch((long *) arg, 1, __ATOMIC_RELAXED);
+    be_free(node);
+    return 0;
+}
+
+static int stop_at_7(const char *rec, size_t len, size_t n, void *arg) 
+{
+    return n == 7 ? 7 : 0;
+}
+
+static void test_log() 
+{
+    char path[64], idx_path[72];
+    be_log_writer_t *w;
+    be_log_t *log;
+    be_node_t *node;
+    const char *rec;
+    size_t len;
+    uint64_t bogus = 1;
+    struct rlimit rl, lim;
+    off_t log_len;
+    long count = 0;
+    int i, fd;
+
+    snprintf(path, sizeof(path), "/tmp/bencode_test_%d.log", (int) getpid());
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    unlink(path);
+    unlink(idx_path);
+
+    w = be_log_writer_open(path);
+    BE_ASSERT(w != NULL);
+    for (i = 0; i < 100; i++) {
+        node = be_alloc(DICT);
+        be_dict_add_num(node, "seq", i);
+        be_dict_add_str(node, "y", "q");
+        BE_ASSERT(be_log_append(w, node) == 0);
+        be_free(node);
+    }
+    BE_ASSERT(be_log_append_raw(w, "i1e2:ab", 7) == -1);
+    BE_ASSERT(be_log_writer_close(w) == 0);
+
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->count == 100 && log->idx_len != 0);
+    rec = be_log_record(log, 42, &len);
+    BE_ASSERT(rec != NULL && memcmp(rec, "d3:seqi42e1:y1:qe", len) == 0);
+    BE_ASSERT(be_log_record(log, 100, &len) == NULL);
+    node = be_log_decode(log, 99);
+    BE_ASSERT(be_dict_lookup_num(node, "seq") == 99);
+    be_free(node);
+    BE_ASSERT(be_log_foreach(log, 0, 100, count_peers, &count) == 0 && count == 100);
+    BE_ASSERT(be_log_parallel(log, 10, 1000, 4, count_peers, &count) == 0 && count == 190);
+    BE_ASSERT(be_log_parallel(log, 0, 100, 3, stop_at_7, NULL) == 7);
+    be_log_close(log);
+
+    /* without an index the log is scanned; a torn tail is dropped on reopen */
+    unlink(idx_path);
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->count == 100 && log->idx_len == 0);
+    be_log_close(log);
+    w = be_log_writer_open(path);
+    BE_ASSERT(w != NULL && write(w->fd, "d3:seq", 6) == 6);
+    be_log_writer_close(w);
+    w = be_log_writer_open(path);
+    BE_ASSERT(w != NULL && be_log_append_raw(w, "d3:seqi100ee", 12) == 0);
+    be_log_writer_close(w);
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->count == 101 && log->idx_len != 0);
+    BE_ASSERT(be_log_foreach(log, 0, 101, count_peers, &count) == 0);
+    log_len = log->len;
+    be_log_close(log);
+
+    /* a record cut short by a write error is removed again */
+    w = be_log_writer_open(path);
+    BE_ASSERT(w != NULL && w->off == log_len);
+    signal(SIGXFSZ, SIG_IGN);
+    getrlimit(RLIMIT_FSIZE, &rl);
+    lim = rl;
+    lim.rlim_cur = log_len + 5;
+    setrlimit(RLIMIT_FSIZE, &lim);
+    BE_ASSERT(be_log_append_raw(w, "d3:seqi101ee", 12) == -1 && errno == EFBIG);
+    setrlimit(RLIMIT_FSIZE, &rl);
+    signal(SIGXFSZ, SIG_DFL);
+    BE_ASSERT(lseek(w->fd, 0, SEEK_END) == log_len && !w->broken);
+    BE_ASSERT(be_log_append_raw(w, "d3:seqi101ee", 12) == 0);
+    be_log_writer_close(w);
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->count == 102 && log->idx_len != 0);
+    be_log_close(log);
+
+    /* an index that goes backwards is ignored */
+    fd = open(idx_path, O_WRONLY);
+    BE_ASSERT(fd >= 0 && pwrite(fd, &bogus, sizeof(bogus), 8 * sizeof(uint64_t)) == sizeof(bogus));
+    close(fd);
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->count == 102 && log->idx_len == 0);
+    be_log_close(log);
+
+    /* records the reader would reject are refused, and a complete but
+       unreadable record is never truncated away with what follows it */
+    unlink(path);
+    unlink(idx_path);
+    node = be_alloc(LIST);
+    for (i = 0; i < BE_MAX_DEPTH; i++) {
+        be_node_t *parent = be_alloc(LIST);
+        list_add_tail(&node->link, &parent->x.list_head);
+        node = parent;
+    }
+    w = be_log_writer_open(path);
+    BE_ASSERT(be_log_append(w, node) == -1 && errno == EINVAL && w->off == 0);
+    BE_ASSERT(write(w->fd, "lllllllllllleeeeeeeeeeee" "i1e", 27) == 27);
+    be_log_writer_close(w);
+    be_free(node);
+    unlink(idx_path);
+    BE_ASSERT(be_log_writer_open(path) == NULL && errno == EINVAL);
+    log = be_log_open(path);
+    BE_ASSERT(log != NULL && log->len == 27 && log->count == 0);
+    be_log_close(log);
+
+    unlink(path);
+    unlink(idx_path);
+}
+
+static void test_compact_tree() 
+{
+    const char *krpc = "d1:ad2:id20:abcdefghij01234567896:target20:mnopqrstuvwxyz123456e1:q9:find_node1:t2:aa1:y1:qe";
+    be_cnode_t *root, *a, *list;
+    const char *str;
+    char buf[128], *key, *c;
+    size_t len, rx;
+
+    root = be_cdecode(krpc, strlen(krpc), &rx);
+    BE_ASSERT(root != NULL && rx == strlen(krpc));
+    BE_ASSERT(sizeof(be_cnode_t) == 24);
+    str = be_cstr(be_cdict_lookup(root, "y"), &len);
+    BE_ASSERT(len == 1 && strcmp(str, "q") == 0);
+    a = be_cdict_lookup(root, "a");
+    BE_ASSERT(a != NULL && strcmp(be_ckey(a), "a") == 0);
+    str = be_cstr(be_cdict_lookup(a, "target"), &len);  // longer than inline
+    BE_ASSERT(len == 20 && strcmp(str, "mnopqrstuvwxyz123456") == 0);
+    BE_ASSERT(be_cdict_lookup(a, "nope") == NULL);
+    be_cfree(root);
+
+    root = be_cadd(NULL, NULL, DICT);
+    BE_ASSERT(be_cadd_num(root, NULL, 1) == NULL);     // dict members need a key
+    be_cadd_num(root, "interval", 1800);
+    list = be_cadd(root, "peers", LIST);
+    be_cadd_str(list, NULL, "short", 5);
+    be_cadd_str(list, NULL, "a string past the inline limit", 30);
+    BE_ASSERT(be_cencode(root, buf, sizeof(buf)) == 67);
+    BE_ASSERT(memcmp(buf, "d8:intervali1800e5:peersl5:short30:a string past the inline limitee", 67) == 0);
+    be_cfree(root);
+
+    /* keys too long for the header are kept out of line */
+    key = malloc(70001);
+    memset(key, 'k', 70000);
+    key[70000] = '\0';
+    root = be_cadd(NULL, NULL, DICT);
+    BE_ASSERT(be_cadd_str(root, key, "v", 1) != NULL);
+    be_cadd_num(root, "n", 1);
+    str = be_cstr(be_cdict_lookup(root, key), &len);
+    BE_ASSERT(str != NULL && len == 1 && strcmp(str, "v") == 0);
+    BE_ASSERT(strcmp(be_ckey(root->x.head), key) == 0);
+    len = be_cencode(root, NULL, 0);
+    BE_ASSERT(len == 70000 + 17);
+    c = malloc(len);
+    BE_ASSERT(be_cencode(root, c, len) == len && memcmp(c, "d70000:kkk", 10) == 0);
+    be_cfree(root);
+    root = be_cdecode(c, len, &rx);
+    BE_ASSERT(root != NULL && rx == len && be_cdict_lookup(root, key) != NULL);
+    be_cfree(root);
+    free(c);
+    free(key);
+}
+
+static void test_lazy() 
+{
+    be_node_t *node, *info, *test, *clone;
+    size_t len = strlen(sample), rx;
+    list_t *l, *head;
+    char *c;
+    int i = 0;
+
+    node = be_decode_lazy(sample, len, &rx, 1);
+    BE_ASSERT(node != NULL && rx == len && node->type == DICT);
+    list_for_each(l, &node->x.dict_head) {
+        be_node_t *val = list_entry(l, be_dict_t, link)->val;
+        BE_ASSERT(val->type == LAZY || val->type == STR || val->type == NUM);
+    }
+    c = encode_alloc(node);                 // copied through untouched
+    BE_ASSERT(strcmp(c, sample) == 0);
+    BE_FREE(c);
+    BE_ASSERT(be_dict_lookup_num(node, "creation date") == 1327049827);
+    info = be_dict_lookup(node, "info", NULL);
+    BE_ASSERT(info->type == DICT);          // expanded by the lookup
+    BE_ASSERT(strcmp(be_dict_lookup_cstr(info, "name"), "sample.txt") == 0);
+
+    test = list_entry(node->x.dict_head.next, be_dict_t, link)->val;
+    BE_ASSERT(test->type == LAZY);
+    be_for_each(l, head, test) {
+        BE_ASSERT(strcmp(list_entry(l, be_node_t, link)->x.str.buf, "test") == 0);
+        i++;
+    }
+    BE_ASSERT(i == 1 && test->type == LIST);
+    be_free(node);
+
+    /* iteration expands what it reaches, however deep it goes */
+    node = be_decode_lazy(sample, len, &rx, 0);
+    i = 0;
+    be_for_each(l, head, node) {
+        be_dict_t *entry = list_entry(l, be_dict_t, link);
+        list_t *l2, *head2;
+        BE_ASSERT(entry->val->type != LAZY);
+        if (entry->val->type == DICT) {
+            be_for_each(l2, head2, entry->val)
+                i += list_entry(l2, be_dict_t, link)->val->type == NUM;
+        }
+    }
+    BE_ASSERT(i == 3);      // info's length, piece length and private
+    be_free(node);
+
+    /* read-modify-write, canonical output, clone and freeze */
+    node = be_decode_lazy(sample, len, &rx, 0);
+    BE_ASSERT(node->type == LAZY);
+    BE_ASSERT(be_encode_canonical(node, NULL, 0) == len);
+    BE_ASSERT(be_dict_add_num(node, "z", 1) == 0 && node->type == DICT);
+    c = encode_alloc(node);
+    BE_ASSERT(strncmp(c, sample, len - 1) == 0 && strcmp(c + len - 1, "1:zi1ee") == 0);
+    BE_FREE(c);
+    clone = be_clone(node);
+    BE_ASSERT(clone != NULL && be_dict_lookup(clone, "info", NULL)->type == DICT);
+    i = 0;
+    list_for_each(l, &node->x.dict_head)   // decoded into the clone, source untouched
+        i += list_entry(l, be_dict_t, link)->val->type == LAZY;
+    BE_ASSERT(i == 2);
+    c = encode_alloc(clone);
+    BE_ASSERT(strncmp(c, sample, len - 1) == 0 && strcmp(c + len - 1, "1:zi1ee") == 0);
+    BE_FREE(c);
+    be_free(clone);
+    BE_ASSERT(be_freeze(node) == node);
+    BE_ASSERT(be_dict_lookup(node, "test", NULL)->type == LIST);
+    be_free(node);
+
+    BE_ASSERT(be_decode_lazy("d1:ali1e", 8, &rx, 1) == NULL && errno == EINVAL);
+    BE_ASSERT(be_decode_lazy("llllllllllll4:testeeeeeeeeeeee", 30, &rx, 1) == NULL);
+}
+
+static void test_stats() 
+{
+    be_stats_t st;
+    be_node_t *node;
+    size_t rx;
+
+    be_stats_reset();
+    node = be_decode(sample, strlen(sample), &rx);
+    BE_ASSERT(node != NULL);
+    BE_ASSERT(be_dict_lookup_num(node, "creation date") == 1327049827);
+    be_free(node);
+    BE_ASSERT(be_decode("12:abc", 6, &rx) == NULL);
+
+    be_stats_thread(&st);
+#ifdef BE_STATS
+    BE_ASSERT(st.op[BE_OP_DECODE].count == 2);
+    BE_ASSERT(st.op[BE_OP_LOOKUP].count == 1);
+    BE_ASSERT(st.op[BE_OP_FREE].count == 1);
+    BE_ASSERT(st.bytes_decoded == strlen(sample));
+    BE_ASSERT(st.nodes_created == 12);
+    BE_ASSERT(st.max_depth == 3);
+    BE_ASSERT(st.errors[EINVAL] == 1);
+    be_stats_dump(&st);
+#else
+    BE_ASSERT(st.op[BE_OP_DECODE].count == 0 && st.nodes_created == 0);
+#endif
+}
+
 int main(void) 
 {
     be_node_t *node;
@@ -192,6 +821,31 @@ int main(void)
     be_free(node);
 
     gen_dict_bt_resp();
+
+    printf("\n* canonical encoding\n");
+    test_canonical();
+
+    printf("\n* compact peers\n");
+    test_compact();
+
+    printf("\n* frozen trees\n");
+    test_frozen();
+    test_frozen_threads();
+
+    printf("\n* clone\n");
+    test_clone();
+
+    printf("\n* compact tree\n");
+    test_compact_tree();
+
+    printf("\n* record log\n");
+    test_log();
+
+    printf("\n* lazy decoding\n");
+    test_lazy();
+
+    printf("\n* stats\n");
+    test_stats();
     
     printf("\nAll tests passed!\n");
 
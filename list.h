@@ -49,6 +49,17 @@ static inline int list_empty(list_t *head) {
     return head->next == head;
 }
 
+static inline void list_splice_init(list_t *list, list_t *head) {
+    if (!list_empty(list)) {
+        list_t *first = list->next, *last = list->prev, *at = head->next;
+        first->prev = head;
+        head->next = first;
+        last->next = at;
+        at->prev = last;
+        init_list_head(list);
+    }
+}
+
 #ifdef container_of
 #define list_entry container_of
 #else